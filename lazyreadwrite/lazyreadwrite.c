@@ -7,12 +7,20 @@
 #include <time.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 
 #define MAX_FILES 100
 #define MAX_USERS 100
-#define MAX_QUEUE_SIZE 1000
-#define MAX_REQUESTS 1000
+#define MAX_QUEUE_SIZE 1024  // must be a power of two
+#define WORKER_THREADS 4
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 5  // the timer wheel spans 2^30 seconds
 
 
 // Colors for output
@@ -23,7 +31,6 @@
 #define RED "\033[0;31m"
 #define RESET "\033[0m"
 
-time_t start;
 // User request structure
 typedef struct
 {
@@ -33,7 +40,73 @@ typedef struct
     int requesttime;
 } userrequest;
 
-userrequest requests[MAX_REQUESTS];
+enum
+{
+    OP_READ,
+    OP_WRITE,
+    OP_DELETE,
+    OP_COUNT
+};
+
+// Where a request is in its life. Requests never own a thread: a worker picks
+// one up whenever something happens to it and otherwise it stays parked here.
+enum
+{
+    PHASE_PENDING,   // not taken up yet
+    PHASE_WAITING,   // parked on its file until there is room
+    PHASE_RUNNING,
+    PHASE_DONE       // completed, declined or canceled
+};
+
+// Things that happen to a request, in the order they are handled when due at the same time
+enum
+{
+    EVENT_TIMEOUT,   // patience ran out
+    EVENT_COMPLETE,  // the operation finished
+    EVENT_ARRIVE,    // the user made the request
+    EVENT_READY      // LAZY may take the request up
+};
+
+// A pending event in a slot of the timer wheel
+typedef struct timernode
+{
+    struct timernode *prev;
+    struct timernode *next;           // NULL while not armed
+    int due;                          // seconds since start
+    int kind;
+    long seq;                         // keeps events of the same time and kind in scheduling order
+    struct requeststate *request;
+} timernode;
+
+typedef struct requeststate
+{
+    userrequest req;
+    int operation;                    // OP_READ, OP_WRITE or OP_DELETE
+    int phase;
+    int deadline;                     // canceled at this time unless taken up before
+    int inputorder;                   // position in the input, the last tie-break of compare_requests
+    timernode step;                   // arrival, then take-up, then completion
+    timernode patience;               // the deadline, disarmed once the request is taken up
+    long parkseq;                     // order in which the file's requests were parked
+    struct requeststate *prevwaiting; // wait queue of the file for the operation
+    struct requeststate *nextwaiting;
+} requeststate;
+
+// Parked requests for one operation on one file, oldest first
+typedef struct
+{
+    requeststate *head;
+    requeststate *tail;
+} waitqueue;
+
+// An event that has fallen due, on its way to a worker
+typedef struct
+{
+    int due;
+    int kind;
+    long seq;
+    requeststate *request;
+} timedevent;
 
 typedef struct
 {
@@ -41,320 +114,733 @@ typedef struct
     int numberofreaders;
     bool is_writing;
     int numberofusers;
-    int requestswaiting;
+    waitqueue waiting[OP_COUNT];      // parked requests by operation
+    long parkseq;
     pthread_mutex_t mutex;
-    pthread_cond_t cond;
 } filestate;
 
 int R, W, D;
 int numberoffile, maxusers, waittime;
-userrequest requestqueue[MAX_QUEUE_SIZE];
-int queuefront = 0, queuerear = 0;
+requeststate *requests;
+int request_count = 0;
 filestate filestates[MAX_FILES];
-pthread_mutex_t queuemutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t queuecond = PTHREAD_COND_INITIALIZER;
-bool isend = false;
+filestate invalidfile;                // stands in for files that do not exist
+atomic_bool isend = false;
 
-void enqueue(userrequest req)
+// Due events travel to the workers through a bounded lock-free multi-producer,
+// multi-consumer ring. Each slot's sequence number says whose turn it is: a
+// producer may fill slot i for position p once it reads p, and a consumer may
+// take it once it reads p + 1, after which it is set to p + MAX_QUEUE_SIZE for
+// the next lap. Producers and consumers claim positions with a CAS and never
+// share a lock. A consumer sleeps on a futex only while the ring is empty, and
+// a producer only while it is full, which holds events back in the timer wheel.
+typedef struct
 {
-    pthread_mutex_lock(&queuemutex);
-    requestqueue[queuerear] = req;
-    queuerear = (queuerear + 1) % MAX_QUEUE_SIZE;
-    pthread_cond_signal(&queuecond);
-    pthread_mutex_unlock(&queuemutex);
+    atomic_size_t sequence;
+    timedevent event;
+} queueslot;
+
+queueslot requestqueue[MAX_QUEUE_SIZE];
+atomic_size_t queuerear = 0;          // next position to fill
+atomic_size_t queuefront = 0;         // next position to take
+atomic_uint queueposted = 0;          // bumped after every enqueue, futex word for consumers
+atomic_uint queuetaken = 0;           // bumped after every dequeue, futex word for producers
+atomic_int consumerssleeping = 0;
+atomic_int producerssleeping = 0;
+
+// Every pending event sits in a hierarchical timer wheel with one second ticks.
+// Slot s of level l holds the events due in the l-th level span starting at s *
+// WHEEL_SLOTS^l seconds, within the span of level l + 1 that contains wheelnow.
+// An event goes on the lowest level that can hold it and cascades down as the
+// wheel turns. Slots are circular lists around a sentinel, so arming and
+// disarming a timer are O(1).
+timernode wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+int wheelnow = 0;                     // tick being handled; nothing earlier is still armed
+int timercount = 0;                   // armed timers
+long timerseq = 0;
+int timerwake = -1;                   // tick the timer thread sleeps until, INT_MAX when idle
+timedevent *firing;                   // events of the tick being handled
+int firingcapacity = 0;
+struct timespec start;                // CLOCK_MONOTONIC at tick 0
+pthread_mutex_t timermutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t timercond;             // waits on CLOCK_MONOTONIC
+
+int finishedcount = 0;
+pthread_mutex_t finishedmutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t finishedcond = PTHREAD_COND_INITIALIZER;
+
+void futexwait(atomic_uint *word, unsigned int seen)
+{
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
 }
 
-userrequest dequeue()
+void futexwake(atomic_uint *word, int count)
 {
-    pthread_mutex_lock(&queuemutex);
-    while ((queuefront == queuerear) && !isend)
-    {
-        pthread_cond_wait(&queuecond, &queuemutex);
-    }
-    userrequest req;
-    if (!isend && !(queuefront == queuerear))
-    {
-        req = requestqueue[queuefront];
-        queuefront = (queuefront + 1) % MAX_QUEUE_SIZE;
-        pthread_mutex_unlock(&queuemutex);
-        return req;
-    }
-    pthread_mutex_unlock(&queuemutex);
-    return (userrequest){-1,-1,-1,-1};
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+void initqueue()
+{
+    for (size_t i = 0; i < MAX_QUEUE_SIZE; i++)
+        atomic_init(&requestqueue[i].sequence, i);
 }
 
-bool readfunction(userrequest req)
+bool tryenqueue(timedevent event)
 {
-    filestate *state = &filestates[req.fileid];
-    while ((int)(time(NULL) - start) < req.requesttime + 1)
+    size_t pos = atomic_load_explicit(&queuerear, memory_order_relaxed);
+    queueslot *slot;
+    while (true)
     {
-        usleep(100000); 
+        slot = &requestqueue[pos & (MAX_QUEUE_SIZE - 1)];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&queuerear, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            return false;             // a whole lap ahead of the consumers: full
+        }
+        else
+        {
+            pos = atomic_load_explicit(&queuerear, memory_order_relaxed);
+        }
     }
-    pthread_mutex_lock(&state->mutex);
-    state->requestswaiting++;
-    struct timespec timeout;
-    clock_gettime(CLOCK_REALTIME, &timeout);
-    timeout.tv_sec += waittime;
-    while (state->numberofusers >= maxusers)
+    slot->event = event;
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+    return true;
+}
+
+bool trydequeue(timedevent *event)
+{
+    size_t pos = atomic_load_explicit(&queuefront, memory_order_relaxed);
+    queueslot *slot;
+    while (true)
     {
-        if ((pthread_cond_timedwait(&state->cond, &state->mutex, &timeout) == ETIMEDOUT) && ((int)(time(NULL) - start) - req.requesttime > waittime)){
-                printf(RED "User %d canceled the request due to no response at %ld seconds [RED]\n" RESET,
-                       req.userid, start);
-                state->requestswaiting--;
-                pthread_mutex_unlock(&state->mutex);
-                return false;
+        slot = &requestqueue[pos & (MAX_QUEUE_SIZE - 1)];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&queuefront, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            return false;             // not filled yet: empty
+        }
+        else
+        {
+            pos = atomic_load_explicit(&queuefront, memory_order_relaxed);
         }
     }
-    if ((int)(time(NULL) - start) - req.requesttime > waittime)
+    *event = slot->event;
+    atomic_store_explicit(&slot->sequence, pos + MAX_QUEUE_SIZE, memory_order_release);
+    return true;
+}
+
+// Queue the event, waiting while the ring is full. Returns false if LAZY is done first.
+bool enqueue(timedevent event)
+{
+    while (true)
     {
-        printf(RED "User %d canceled the request due to no response at %ld seconds [RED]\n" RESET,
-               req.userid, start);
-        state->requestswaiting--;
-        pthread_mutex_unlock(&state->mutex);
-        return false;
+        // Read the futex word before trying, so a dequeue in between makes the wait return at once
+        unsigned int seen = atomic_load(&queuetaken);
+        if (tryenqueue(event))
+            break;
+        if (isend)
+            return false;
+        atomic_fetch_add(&producerssleeping, 1);
+        futexwait(&queuetaken, seen);
+        atomic_fetch_sub(&producerssleeping, 1);
     }
-    state->requestswaiting--;
-    if (req.fileid >= numberoffile || !filestates[req.fileid].isexisting)
+    atomic_fetch_add(&queueposted, 1);
+    if (atomic_load(&consumerssleeping) > 0)
+        futexwake(&queueposted, 1);
+    return true;
+}
+
+// Next event to handle, or one without a request once LAZY is done
+timedevent dequeue()
+{
+    timedevent event;
+    while (true)
     {
-        printf(WHITE "LAZY has declined the request of User %d at %d seconds because an invalid/deleted file was requested. [WHITE]\n" RESET,
-               req.userid, (int)(time(NULL) - start));
-        pthread_mutex_unlock(&state->mutex);
-        return false;
+        unsigned int seen = atomic_load(&queueposted);
+        if (trydequeue(&event))
+            break;
+        if (isend)
+            return (timedevent){-1, -1, -1, NULL};
+        atomic_fetch_add(&consumerssleeping, 1);
+        futexwait(&queueposted, seen);
+        atomic_fetch_sub(&consumerssleeping, 1);
     }
-    printf(PINK "LAZY has taken up the request of User %d at %d seconds [PINK]\n" RESET,req.userid, (int)(time(NULL) - start));
-    state->numberofusers++;
-    state->numberofreaders++;
-    pthread_mutex_unlock(&state->mutex);
-    sleep(R);
-    pthread_mutex_lock(&state->mutex);
-    printf(GREEN "The request for User %d was completed at %d seconds [GREEN]\n" RESET,req.userid, (int)(time(NULL) - start));
-    state->numberofusers--;
-    state->numberofreaders--;
-     for (int i = 0; i < state->requestswaiting; i++) {
-        pthread_cond_signal(&state->cond);
-        usleep(1000);
+    atomic_fetch_add(&queuetaken, 1);
+    if (atomic_load(&producerssleeping) > 0)
+        futexwake(&queuetaken, 1);
+    return event;
+}
+
+// Wake every thread sleeping on the ring so it sees isend
+void closequeue()
+{
+    isend = true;
+    atomic_fetch_add(&queueposted, 1);
+    atomic_fetch_add(&queuetaken, 1);
+    futexwake(&queueposted, INT_MAX);
+    futexwake(&queuetaken, INT_MAX);
+}
+
+bool eventbefore(const timedevent *a, const timedevent *b)
+{
+    if (a->due != b->due)
+        return a->due < b->due;
+    if (a->kind != b->kind)
+        return a->kind < b->kind;
+    return a->seq < b->seq;
+}
+
+int compare_events(const void *a, const void *b)
+{
+    return eventbefore(a, b) ? -1 : eventbefore(b, a) ? 1 : 0;
+}
+
+void wheelinsert(timernode *node)
+{
+    // Late events fire on the current tick, keeping their own time
+    int due = node->due < wheelnow ? wheelnow : node->due;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 &&
+           (due >> (WHEEL_BITS * (level + 1))) != (wheelnow >> (WHEEL_BITS * (level + 1))))
+        level++;
+    timernode *slot = &wheel[level][(due >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+    node->prev = slot->prev;
+    node->next = slot;
+    slot->prev->next = node;
+    slot->prev = node;
+}
+
+void wheelunlink(timernode *node)
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->next = NULL;
+}
+
+// Arm the request's timer for the event; the timer thread queues it for the workers once it is due
+void scheduleevent(requeststate *rs, int kind, int due)
+{
+    timernode *node = (kind == EVENT_TIMEOUT) ? &rs->patience : &rs->step;
+    pthread_mutex_lock(&timermutex);
+    node->due = due;
+    node->kind = kind;
+    node->seq = timerseq++;
+    node->request = rs;
+    wheelinsert(node);
+    timercount++;
+    if (due < timerwake)
+        pthread_cond_signal(&timercond);
+    pthread_mutex_unlock(&timermutex);
+}
+
+// Disarm the request's patience timer, which then never fires
+void canceltimeout(requeststate *rs)
+{
+    pthread_mutex_lock(&timermutex);
+    if (rs->patience.next)
+    {
+        wheelunlink(&rs->patience);
+        timercount--;
     }
-    pthread_mutex_unlock(&state->mutex);
-    return true;
+    pthread_mutex_unlock(&timermutex);
 }
 
-bool writefunction(userrequest req)
+// Earliest tick from wheelnow on at which a timer fires or a slot cascades, or -1 if none is armed
+int nexttick()
 {
-    filestate *state = &filestates[req.fileid];
-    while ((int)(time(NULL) - start) < req.requesttime + 1)
+    int best = -1;
+    if (timercount == 0)
+        return best;
+    for (int level = 0; level < WHEEL_LEVELS; level++)
     {
-        usleep(100000); 
+        int shift = WHEEL_BITS * level;
+        int index = (wheelnow >> shift) & (WHEEL_SLOTS - 1);
+        for (int slot = (level == 0) ? index : index + 1; slot < WHEEL_SLOTS; slot++)
+        {
+            if (wheel[level][slot].next != &wheel[level][slot])
+            {
+                int tick = ((wheelnow >> (shift + WHEEL_BITS)) << (shift + WHEEL_BITS)) | (slot << shift);
+                if (best < 0 || tick < best)
+                    best = tick;
+                break;
+            }
+        }
     }
-    pthread_mutex_lock(&state->mutex);
-    struct timespec timeout;
-    clock_gettime(CLOCK_REALTIME, &timeout);
-    timeout.tv_sec += waittime;
-    state->requestswaiting++;
-    while (state->numberofusers >= maxusers || state->is_writing)
+    return best;
+}
+
+// Turn the wheel to tick, cascading the slots whose span starts there, and move
+// the events due at it into firing in (kind, seq) order. Returns how many there are.
+int expiretick(int tick)
+{
+    if (tick != wheelnow)
     {
-            if ((pthread_cond_timedwait(&state->cond, &state->mutex, &timeout) == ETIMEDOUT)&&((int)(time(NULL) - start) - req.requesttime > waittime))
+        wheelnow = tick;
+        for (int level = WHEEL_LEVELS - 1; level > 0; level--)
+        {
+            int shift = WHEEL_BITS * level;
+            if (tick & ((1 << shift) - 1))
+                continue;
+            timernode *slot = &wheel[level][(tick >> shift) & (WHEEL_SLOTS - 1)];
+            while (slot->next != slot)
             {
-                printf(RED "User %d canceled the request due to no response at %d seconds [RED]\n" RESET,
-                       req.userid, (int)(time(NULL) - start));
-                pthread_mutex_unlock(&state->mutex);
-                state->requestswaiting--;
-                return false;
+                timernode *node = slot->next;
+                wheelunlink(node);
+                wheelinsert(node);
             }
+        }
     }
-            if ((int)(time(NULL) - start) - req.requesttime > waittime)
+    int count = 0;
+    timernode *slot = &wheel[0][tick & (WHEEL_SLOTS - 1)];
+    while (slot->next != slot)
+    {
+        timernode *node = slot->next;
+        if (count == firingcapacity)
+        {
+            firingcapacity = firingcapacity ? firingcapacity * 2 : 1024;
+            firing = realloc(firing, firingcapacity * sizeof(timedevent));
+            if (firing == NULL)
             {
-                printf(RED "User %d canceled the request due to no response at %d seconds [RED]\n" RESET,
-                       req.userid,(int)(time(NULL) - start));
-                pthread_mutex_unlock(&state->mutex);
-                state->requestswaiting--;
-                return false;
+                fprintf(stderr, "Memory allocation failed\n");
+                exit(1);
             }
-    state->requestswaiting--;
-    if (req.fileid >= numberoffile || !filestates[req.fileid].isexisting)
+        }
+        firing[count++] = (timedevent){node->due, node->kind, node->seq, node->request};
+        wheelunlink(node);
+        timercount--;
+    }
+    qsort(firing, count, sizeof(timedevent), compare_events);
+    return count;
+}
+
+// Releases events to the workers as they fall due on the monotonic clock
+void *timerthread(void *arg)
+{
+    pthread_mutex_lock(&timermutex);
+    while (!isend)
     {
-        printf(WHITE "LAZY has declined the request of User %d at %d seconds because an invalid/deleted file was requested. [WHITE]\n" RESET,
-               req.userid, (int)(time(NULL) - start));
-        pthread_mutex_unlock(&state->mutex);
+        int tick = nexttick();
+        if (tick < 0)
+        {
+            timerwake = INT_MAX;
+            pthread_cond_wait(&timercond, &timermutex);
+            continue;
+        }
+        struct timespec due = {start.tv_sec + tick, start.tv_nsec};
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec < due.tv_sec || (now.tv_sec == due.tv_sec && now.tv_nsec < due.tv_nsec))
+        {
+            timerwake = tick;
+            pthread_cond_timedwait(&timercond, &timermutex, &due);
+            continue;
+        }
+        timerwake = -1;
+        int count = expiretick(tick);
+        pthread_mutex_unlock(&timermutex);
+        for (int i = 0; i < count; i++)
+            if (!enqueue(firing[i]))
+                break;
+        pthread_mutex_lock(&timermutex);
+    }
+    pthread_mutex_unlock(&timermutex);
+    return NULL;
+}
+
+void finishrequest(requeststate *rs)
+{
+    rs->phase = PHASE_DONE;
+    pthread_mutex_lock(&finishedmutex);
+    if (++finishedcount == request_count)
+        pthread_cond_signal(&finishedcond);
+    pthread_mutex_unlock(&finishedmutex);
+}
+
+filestate *fileof(const requeststate *rs)
+{
+    if (rs->req.fileid < 0 || rs->req.fileid >= numberoffile)
+        return &invalidfile;
+    return &filestates[rs->req.fileid];
+}
+
+// Can the operation start on the file right now? The answer is the same for
+// every request of the operation, so a wait queue only ever needs its head checked.
+bool canstart(filestate *state, int operation)
+{
+    if (state->numberofusers >= maxusers || (operation != OP_READ && state->is_writing))
         return false;
+    return operation != OP_DELETE || state->numberofreaders == 0;
+}
+
+void declinerequest(requeststate *rs, int now)
+{
+    printf(WHITE "LAZY has declined the request of User %d at %d seconds because an invalid/deleted file was requested. [WHITE]\n" RESET,
+           rs->req.userid, now);
+    finishrequest(rs);
+}
+
+void parkrequest(filestate *state, requeststate *rs)
+{
+    waitqueue *queue = &state->waiting[rs->operation];
+    rs->phase = PHASE_WAITING;
+    rs->parkseq = state->parkseq++;
+    rs->nextwaiting = NULL;
+    rs->prevwaiting = queue->tail;
+    if (queue->tail)
+        queue->tail->nextwaiting = rs;
+    else
+        queue->head = rs;
+    queue->tail = rs;
+}
+
+void unparkrequest(filestate *state, requeststate *rs)
+{
+    waitqueue *queue = &state->waiting[rs->operation];
+    if (rs->prevwaiting)
+        rs->prevwaiting->nextwaiting = rs->nextwaiting;
+    else
+        queue->head = rs->nextwaiting;
+    if (rs->nextwaiting)
+        rs->nextwaiting->prevwaiting = rs->prevwaiting;
+    else
+        queue->tail = rs->prevwaiting;
+}
+
+void cancelrequest(requeststate *rs, int when)
+{
+    printf(RED "User %d canceled the request due to no response at %d seconds [RED]\n" RESET, rs->req.userid, when);
+    finishrequest(rs);
+}
+
+// The longest parked request, only among operations that can start now if startable is set
+requeststate *oldestwaiting(filestate *state, bool startable)
+{
+    requeststate *oldest = NULL;
+    for (int operation = 0; operation < OP_COUNT; operation++)
+    {
+        requeststate *rs = state->waiting[operation].head;
+        if (rs && (!startable || canstart(state, operation)) && (!oldest || rs->parkseq < oldest->parkseq))
+            oldest = rs;
     }
-    printf(PINK "LAZY has taken up the request of User %d to WRITE at %d seconds [PINK]\n" RESET,
-           req.userid, (int)(time(NULL) - start));
+    return oldest;
+}
 
+// Take the request up; called with the file's mutex held
+void startrequest(filestate *state, requeststate *rs, int now)
+{
+    int duration;
+    rs->phase = PHASE_RUNNING;
+    canceltimeout(rs);
     state->numberofusers++;
-    state->is_writing = true;
-    pthread_mutex_unlock(&state->mutex);
-    sleep(W);
-    pthread_mutex_lock(&state->mutex);
-    printf(GREEN "The request for User %d was completed at %d seconds [GREEN]\n" RESET,
-           req.userid, (int)(time(NULL) - start));
-    state->numberofusers--;
-    state->is_writing = false;
-     for (int i = 0; i < state->requestswaiting; i++) {
-        pthread_cond_signal(&state->cond);
-        usleep(1000);
+    if (rs->operation == OP_READ)
+    {
+        printf(PINK "LAZY has taken up the request of User %d at %d seconds [PINK]\n" RESET, rs->req.userid, now);
+        state->numberofreaders++;
+        duration = R;
     }
-    pthread_mutex_unlock(&state->mutex);
-    return true;
+    else if (rs->operation == OP_WRITE)
+    {
+        printf(PINK "LAZY has taken up the request of User %d to WRITE at %d seconds [PINK]\n" RESET,
+               rs->req.userid, now);
+        state->is_writing = true;
+        duration = W;
+    }
+    else
+    {
+        printf(PINK "LAZY has taken up the request of User %d at %d seconds [PINK]\n" RESET, rs->req.userid, now);
+        state->isexisting = false;
+        duration = D;
+    }
+    scheduleevent(rs, EVENT_COMPLETE, now + duration);
 }
 
-bool deletefunction(userrequest req)
+// A deleted file declines everything that was waiting for it, oldest first
+void declinewaiting(filestate *state, int now)
 {
-    filestate *state = &filestates[req.fileid];
-    while ((int)(time(NULL) - start) < req.requesttime + 1)
+    requeststate *rs;
+    while ((rs = oldestwaiting(state, false)))
     {
-        usleep(100000); 
+        unparkrequest(state, rs);
+        canceltimeout(rs);
+        declinerequest(rs, now);
     }
-    pthread_mutex_lock(&state->mutex);
-    struct timespec timeout;
-    clock_gettime(CLOCK_REALTIME, &timeout);
-    timeout.tv_sec += waittime;
-    state->requestswaiting++;
-    while (state->numberofusers >= maxusers || state->is_writing || state->numberofreaders > 0 )
+}
+
+// Hand the file directly to the parked requests that can start now, oldest
+// first: readers up to the user limit, a writer once nobody writes, or a
+// deleter once nobody reads or writes. Only the queue heads are looked at, so
+// this costs O(admitted) and touches nobody who stays parked.
+void admitwaiting(filestate *state, int now)
+{
+    requeststate *rs;
+    while ((rs = oldestwaiting(state, true)))
     {
-         if (!state->isexisting)
+        unparkrequest(state, rs);
+        if (now >= rs->deadline)
         {
-            printf(WHITE "LAZY has declined the request of User %d at %d seconds because an invalid/deleted file was requested. [WHITE]\n" RESET,
-                req.userid, (int)(time(NULL) - start));
-            pthread_mutex_unlock(&state->mutex);
-            state->requestswaiting--;
-            return false;
+            // Out of patience, its timeout is on its way
+            cancelrequest(rs, rs->deadline);
+            continue;
+        }
+        startrequest(state, rs, now);
+        if (!state->isexisting)
+        {
+            declinewaiting(state, now);
+            return;
         }
-            if ((pthread_cond_timedwait(&state->cond, &state->mutex, &timeout) == ETIMEDOUT)&&(int)(time(NULL) - start) - req.requesttime > waittime)
-            {
-                printf(RED "User %d canceled the request due to no response at %d seconds [RED]\n" RESET,
-                       req.userid, (int)(time(NULL) - start));
-                pthread_mutex_unlock(&state->mutex);
-                state->requestswaiting--;
-                return false;
-            }
     }
-    if ((int)(time(NULL) - start) - req.requesttime > waittime)
+}
+
+void arriverequest(requeststate *rs)
+{
+    userrequest req = rs->req;
+    printf(YELLOW "User %d has made a request for performing %s on file %d at %d seconds [YELLOW]\n" RESET,
+           req.userid, req.operation_type, req.fileid + 1, req.requesttime);
+    scheduleevent(rs, EVENT_TIMEOUT, rs->deadline);
+    scheduleevent(rs, EVENT_READY, req.requesttime + 1);
+}
+
+void readyrequest(requeststate *rs, int now)
+{
+    filestate *state = fileof(rs);
+    pthread_mutex_lock(&state->mutex);
+    if (rs->phase != PHASE_PENDING)
     {
-        printf(RED "User %d canceled the request due to no response at %d seconds [RED]\n" RESET,
-               req.userid, (int)(time(NULL) - start));
-        pthread_mutex_unlock(&state->mutex);
-        state->requestswaiting--;
-        return false;
+        // Canceled before LAZY got to it
     }
-    state->requestswaiting--;
-    if (!state->isexisting)
+    else if (now >= rs->deadline)
     {
-        printf(WHITE "LAZY has declined the request of User %d at %d seconds because an invalid/deleted file was requested. [WHITE]\n" RESET,
-               req.userid, (int)(time(NULL) - start));
-        pthread_mutex_unlock(&state->mutex);
-        return false;
+        cancelrequest(rs, rs->deadline);
+    }
+    else if (!state->isexisting)
+    {
+        canceltimeout(rs);
+        declinerequest(rs, now);
+    }
+    else if (canstart(state, rs->operation))
+    {
+        startrequest(state, rs, now);
+        if (!state->isexisting)
+            declinewaiting(state, now);
+    }
+    else
+    {
+        parkrequest(state, rs);
     }
-    printf(PINK "LAZY has taken up the request of User %d at %d seconds [PINK]\n" RESET,
-           req.userid, (int)(time(NULL) - start));
-
-    state->isexisting = false;
     pthread_mutex_unlock(&state->mutex);
-    sleep(D);
+}
+
+void completerequest(requeststate *rs, int now)
+{
+    filestate *state = fileof(rs);
     pthread_mutex_lock(&state->mutex);
-    printf(GREEN "The request for User %d was completed at %d seconds [GREEN]\n" RESET,
-           req.userid, (int)(time(NULL) - start));
+    printf(GREEN "The request for User %d was completed at %d seconds [GREEN]\n" RESET, rs->req.userid, now);
     state->numberofusers--;
-    pthread_cond_broadcast(&state->cond);
+    if (rs->operation == OP_READ)
+        state->numberofreaders--;
+    else if (rs->operation == OP_WRITE)
+        state->is_writing = false;
+    finishrequest(rs);
+    admitwaiting(state, now);
     pthread_mutex_unlock(&state->mutex);
-    return true;
 }
 
+void timeoutrequest(requeststate *rs, int now)
+{
+    filestate *state = fileof(rs);
+    pthread_mutex_lock(&state->mutex);
+    if (rs->phase == PHASE_WAITING)
+        unparkrequest(state, rs);
+    if (rs->phase == PHASE_PENDING || rs->phase == PHASE_WAITING)
+        cancelrequest(rs, now);
+    pthread_mutex_unlock(&state->mutex);
+}
 
+void handleevent(timedevent event)
+{
+    switch (event.kind)
+    {
+    case EVENT_ARRIVE:
+        arriverequest(event.request);
+        break;
+    case EVENT_READY:
+        readyrequest(event.request, event.due);
+        break;
+    case EVENT_COMPLETE:
+        completerequest(event.request, event.due);
+        break;
+    case EVENT_TIMEOUT:
+        timeoutrequest(event.request, event.due);
+        break;
+    }
+}
 
+// Pool worker: handles whatever happens to any request next
+void *workerthread(void *arg)
+{
+    while (true)
+    {
+        timedevent event = dequeue();
+        if (event.request == NULL)
+            return NULL;
+        handleevent(event);
+    }
+}
 
-void *process_request(void *arg)
+// Discrete-event replay: the wheel turns straight to the next tick with events,
+// so a trace runs as fast as its events can be handled, on this thread alone.
+// The handlers are the ones the workers use, and each tick's events come out in
+// the order the timer thread releases them, so every decision is the same as in real time.
+void simulate()
 {
-    userrequest req = dequeue();
-    if (req.userid == -1)
-        return NULL;
-    while ((int)(time(NULL) - start) < req.requesttime)
-        usleep(100000);
-    if (strcmp(req.operation_type, "READ") == 0) {
-        printf(YELLOW "User %d has made a request for performing READ on file %d at %d seconds [YELLOW]\n" RESET,
-            req.userid, req.fileid + 1, req.requesttime);
-        readfunction(req);
-    } else if (strcmp(req.operation_type, "WRITE") == 0) {
-        printf(YELLOW "User %d has made a request for performing WRITE on file %d at %d seconds [YELLOW]\n" RESET,
-            req.userid, req.fileid + 1, req.requesttime);
-        writefunction(req);
-    } else if (strcmp(req.operation_type, "DELETE") == 0) {
-        printf(YELLOW "User %d has made a request for performing DELETE on file %d at %d seconds [YELLOW]\n" RESET,
-            req.userid, req.fileid + 1, req.requesttime);
-        deletefunction(req);
+    int tick;
+    while (finishedcount < request_count && (tick = nexttick()) >= 0)
+    {
+        int count = expiretick(tick);
+        for (int i = 0; i < count; i++)
+            handleevent(firing[i]);
     }
-   return NULL;
 }
 
 
 int compare_requests(const void* a, const void* b) {
-    userrequest* req1 = (userrequest*)a;
-    userrequest* req2 = (userrequest*)b;
-    int time_diff = req1->requesttime - req2->requesttime;
+    const requeststate* rs1 = (const requeststate*)a;
+    const requeststate* rs2 = (const requeststate*)b;
+    int time_diff = rs1->req.requesttime - rs2->req.requesttime;
     if (time_diff != 0) {
         return time_diff;
     }
 
-    // Now compare based on operation_type priority (READ < WRITE < DELETE)
-    if (strcmp(req1->operation_type, "READ") == 0 && 
-        (strcmp(req2->operation_type, "WRITE") == 0 || strcmp(req2->operation_type, "DELETE") == 0)) {
-        return -1; // READ comes before WRITE and DELETE
-    } 
-    if (strcmp(req1->operation_type, "WRITE") == 0 && strcmp(req2->operation_type, "DELETE") == 0) {
-        return -1; // WRITE comes before DELETE
+    // Now compare based on operation priority (READ < WRITE < DELETE)
+    if (rs1->operation != rs2->operation) {
+        return rs1->operation - rs2->operation;
     }
-    if(strcmp(req1->operation_type,req2->operation_type)==0){return 0;}
-    return 1; // Otherwise, req1 comes after req2
+    // qsort is not stable, so equal requests keep their input order explicitly
+    return rs1->inputorder - rs2->inputorder;
 }
 
 
-int main()
+int main(int argc, char *argv[])
 {
-   int request_count = 0;
+    int request_capacity = 0;
+    bool simulation = false;
+    if (argc == 2 && (strcmp(argv[1], "-s") == 0 || strcmp(argv[1], "--simulate") == 0))
+        simulation = true;
+    else if (argc > 1) {
+        fprintf(stderr, "Usage: %s [-s|--simulate] < requests\n", argv[0]);
+        return 1;
+    }
     scanf("%d %d %d", &R, &W, &D);
     scanf("%d %d %d", &numberoffile, &maxusers, &waittime);
-    waittime--;
     char input[20];int userid, fileid, requesttime;char oper[100];
-    while (true) {
-        scanf("%s", input);
+    while (scanf("%19s", input) == 1) {
         if (strcmp(input, "STOP") == 0)
             break;
         userid = atoi(input);
-        scanf("%d %s %d", &fileid, oper, &requesttime);
-        requests[request_count++] = (userrequest){
-            userid, 
-            fileid - 1, 
-            "",  // Empty string initialization
-            requesttime
-        };
-strcpy(requests[request_count - 1].operation_type, oper);  // Copy oper to the operation_type field
-    }
-    qsort(requests, request_count, sizeof(userrequest), compare_requests);
-    for (int i = 0; i < request_count; i++) {
-        enqueue(requests[i]);
+        if (scanf("%d %99s %d", &fileid, oper, &requesttime) != 3)
+            break;
+        int operation = (strcmp(oper, "READ") == 0) ? OP_READ :
+                        (strcmp(oper, "WRITE") == 0) ? OP_WRITE :
+                        (strcmp(oper, "DELETE") == 0) ? OP_DELETE : -1;
+        if (operation < 0)
+            continue;
+        if (request_count == request_capacity) {
+            request_capacity = request_capacity ? request_capacity * 2 : 1024;
+            requests = realloc(requests, request_capacity * sizeof(requeststate));
+            if (requests == NULL) {
+                fprintf(stderr, "Memory allocation failed\n");
+                return 1;
+            }
+        }
+        requeststate *rs = &requests[request_count++];
+        memset(rs, 0, sizeof(*rs));
+        rs->req = (userrequest){userid, fileid - 1, "", requesttime};
+        snprintf(rs->req.operation_type, sizeof(rs->req.operation_type), "%.9s", oper);
+        rs->operation = operation;
+        rs->phase = PHASE_PENDING;
+        // A request is canceled once the user has waited T seconds for it
+        rs->deadline = requesttime + waittime;
+        rs->inputorder = request_count - 1;
     }
+    qsort(requests, request_count, sizeof(requeststate), compare_requests);
+    if (numberoffile > MAX_FILES)
+        numberoffile = MAX_FILES;
     for (int i = 0; i < numberoffile; i++)
     {
         filestates[i].numberofusers = 0;
         filestates[i].isexisting = true;
         filestates[i].is_writing = false;
         filestates[i].numberofreaders = 0;
-        filestates[i].requestswaiting = 0;
+        memset(filestates[i].waiting, 0, sizeof(filestates[i].waiting));
+        filestates[i].parkseq = 0;
         pthread_mutex_init(&filestates[i].mutex, NULL);
     }
-    time(&start);
+    pthread_mutex_init(&invalidfile.mutex, NULL);
+    for (int level = 0; level < WHEEL_LEVELS; level++)
+        for (int slot = 0; slot < WHEEL_SLOTS; slot++)
+            wheel[level][slot].prev = wheel[level][slot].next = &wheel[level][slot];
+    pthread_condattr_t timerattr;
+    pthread_condattr_init(&timerattr);
+    pthread_condattr_setclock(&timerattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&timercond, &timerattr);
+    clock_gettime(CLOCK_MONOTONIC, &start);
     printf(WHITE "LAZY has woken up!\n" RESET);
-     pthread_t request_threads[request_count];
-    for (int i = 0; i < request_count; ++i) {
-        int status = pthread_create(&request_threads[i], NULL, process_request, NULL);
-        if (status != 0) {
-            fprintf(stderr, "Error creating thread for request %d\n", i);
+
+    for (int i = 0; i < request_count; ++i)
+        scheduleevent(&requests[i], EVENT_ARRIVE, requests[i].req.requesttime);
+    if (simulation) {
+        simulate();
+        printf(WHITE "LAZY has no more pending requests and is going back to sleep!\n" RESET);
+        free(firing);
+        free(requests);
+        return 0;
+    }
+
+    // A fixed pool of workers serves every request; nothing sleeps through an operation
+    initqueue();
+    pthread_t workers[WORKER_THREADS];
+    pthread_t timer;
+    for (int i = 0; i < WORKER_THREADS; ++i) {
+        if (pthread_create(&workers[i], NULL, workerthread, NULL) != 0) {
+            fprintf(stderr, "Error creating worker thread %d\n", i);
+            return 1;
         }
-        usleep(500);}
-    for (int i = 0; i < request_count; ++i) {
-        if (pthread_join(request_threads[i], NULL) != 0) {
-            fprintf(stderr, "Error joining thread for request %d\n", i);
+    }
+    if (pthread_create(&timer, NULL, timerthread, NULL) != 0) {
+        fprintf(stderr, "Error creating timer thread\n");
+        return 1;
+    }
+
+    pthread_mutex_lock(&finishedmutex);
+    while (finishedcount < request_count)
+        pthread_cond_wait(&finishedcond, &finishedmutex);
+    pthread_mutex_unlock(&finishedmutex);
+
+    pthread_mutex_lock(&timermutex);
+    closequeue();
+    pthread_cond_signal(&timercond);
+    pthread_mutex_unlock(&timermutex);
+    for (int i = 0; i < WORKER_THREADS; ++i) {
+        if (pthread_join(workers[i], NULL) != 0) {
+            fprintf(stderr, "Error joining worker thread %d\n", i);
         }}
-    isend = true;
+    pthread_join(timer, NULL);
     printf(WHITE "LAZY has no more pending requests and is going back to sleep!\n" RESET);
+    free(firing);
+    free(requests);
     return 0;
 }
@@ -1,392 +1,4112 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
-#include <time.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <ctype.h>
 #include <limits.h>
+#include <float.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <errno.h>
 
 #define MAX_FILENAME 9 // 8 + NULL (ideally keep an odd number here)
-#define NUM_THREADS 4
-#define count_BASE (28 * 28)  // For processing 2 characters at once (26 letters + dot + space)
-#define THRESHOLD 42
+#define SMALL_SORT_MAX 256  // At or below this many records sort on the calling thread
+#define SAMPLE_SIZE 1024  // Keys the engine selector samples
+#define CALIBRATION_ITEMS 65536  // Keys the startup microbenchmark sorts
+#define FORK_JOIN_GRAIN 16384  // Merge sort tasks at or below this size run sequentially
+#define SAMPLE_SORT_BUCKETS_PER_THREAD 4
+#define SAMPLE_SORT_OVERSAMPLE 32  // Sampled items per sample sort bucket
+#define INSERTION_SORT_CUTOFF 16  // Runs this short are insertion sorted in merge sort
+
+#define TIMESTAMP_LEN 19  // YYYY-MM-DDTHH:MM:SS
+#define MAX_SORT_COLUMNS 3  // columns in a composite sort specification
+#define SORT_SPEC_LEN 64  // longest sort specification line
+#define READ_BLOCK_SIZE (1 << 20)  // stdin is read in blocks this large
+#define OUTPUT_BATCH 65536  // records each worker formats per output round
+#define SELECT_PARALLEL_MIN (1 << 16)  // selection partitions this large run on the pool
+#define SELECT_DIGIT_BITS 11  // radix select digit width
+#define COLUMNAR_MAGIC "LZSORTC1"  // first 8 bytes of a columnar file
+#define COLUMNAR_BYTE_ORDER 0x01020304u
+#define MERGE_BUFFER_SIZE (1 << 20)  // output buffer of a catalog merge
+#define RUN_HEADER_SIZE 12  // u64 key + u32 length before every record of a run file
+#define RUN_BUFFER_MIN (64 * 1024)  // smallest read buffer per run during the final merge
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// Allocations go through these counting wrappers, for the allocation column of --bench
+atomic_long alloc_count;
+
+static inline void* counted_malloc(size_t size) {
+    atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+    return malloc(size);
+}
+
+static inline void* counted_calloc(size_t count, size_t size) {
+    atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+    return calloc(count, size);
+}
 
+static inline void* counted_realloc(void* ptr, size_t size) {
+    atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+    return realloc(ptr, size);
+}
+
+// Columnar record store. Each sortable column is its own contiguous array so the
+// key loops stream through exactly the bytes they need; the display strings are
+// only touched when printing and live in one arena, addressed by offset.
+// The arena is the input text itself, so strings are not NUL terminated.
 typedef struct {
-    char name[MAX_FILENAME];
-    int id;
-    char timestamp[20];
-    unsigned long long name_hash;  // Changed to unsigned for count sort
-    long long timestamp_val;
-} FileRecord;
-
-typedef struct {
-    FileRecord* records;
-    FileRecord* output;
-    int start;
-    int end;
-    int exp;
-    char sort_by;
+    int n;
+    int* ids;
+    long long* timestamp_vals;
+    unsigned long long* name_keys;
+    size_t* name_offs;
+    unsigned int* name_lens;
+    size_t* timestamp_offs;      // every timestamp is TIMESTAMP_LEN bytes
+    unsigned int max_name_len;   // longest name, set by parse_records
+    int mapped;                  // columns point into a columnar file, not owned
+    const char* arena;           // borrowed, owned by the InputBuffer it was parsed from
+} RecordStore;
+
+// The whole input, either mmapped from a file or read from stdin in large blocks
+typedef struct {
+    char* data;
+    size_t len;
+    int mapped;
+} InputBuffer;
+
+// What the sorters actually move: the record's sort key and its index in the
+// record store. Records are reached through idx only when printing.
+typedef struct {
+    unsigned long long key;
+    unsigned int idx;
+} SortItem;
+
+typedef struct {
+    SortItem* items;
+    SortItem* output;
+    int n;
+    int digit_bits;              // radix of every pass is 2^digit_bits
+    int* histograms;             // nthreads x 2^digit_bits, one row per worker
+    unsigned long long* min_vals; // per-worker key range, reduced by every worker
+    unsigned long long* max_vals;
 } ThreadArgs;
 
+// A task runs on every worker of the pool as task(arg, tid, nthreads)
+typedef void (*pool_task_fn)(void* arg, int tid, int nthreads);
+
+// Long-lived worker pool. The thread calling pool_run() takes part as worker 0,
+// so a pool of nthreads owns nthreads - 1 pthreads.
 typedef struct {
-    FileRecord* records;
-    int start;
-    int end;
-    char sort_by;
-} MergeSortArgs;
+    pthread_t* threads;
+    int nthreads;
+    int started;
+    int shutdown;
+    unsigned long generation;    // bumped once per pool_run()
+    pool_task_fn task;
+    void* arg;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_barrier_t barrier;   // phase barrier for tasks, also marks task completion
+} WorkerPool;
+
+typedef struct {
+    WorkerPool* pool;
+    int tid;
+} PoolWorkerArgs;
+
+WorkerPool sort_pool;
+int sort_threads = 0;            // size of sort_pool, 0 until chosen
+
+// Wait until every worker of the pool reaches this point.
+// Returns nonzero in exactly one worker, which may then do serial work between phases.
+int pool_barrier(WorkerPool* pool) {
+    return pthread_barrier_wait(&pool->barrier) == PTHREAD_BARRIER_SERIAL_THREAD;
+}
 
-// Modified hash calculation to process 2 characters at once
-unsigned long long calculate_name_hash(const char* name) {
-    unsigned long long hash = 0;
-    int len = strlen(name);
+void* pool_worker(void* arg) {
+    PoolWorkerArgs* args = (PoolWorkerArgs*)arg;
+    WorkerPool* pool = args->pool;
+    int tid = args->tid;
+    unsigned long seen = 0;
+    free(args);
     
-    // Process pairs of characters
-    for (int i = 0; i < len; i += 2) {
-        unsigned long long pair_value = 0;
-        
-        // First character of the pair
-        char c1 = tolower(name[i]);
-        if (c1 == ' ') {
-            pair_value = 0;
-        } else {
-            int val1 = (c1 == '.') ? 1 : (c1 - 'a' + 2);
-            pair_value = val1;
+    while (1) {
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->generation == seen && !pool->shutdown) {
+            pthread_cond_wait(&pool->cond, &pool->mutex);
         }
-        
-        // Second character of the pair (if exists)
-        if (i + 1 < len) {
-            char c2 = tolower(name[i + 1]);
-            if (c2 == ' ') {
-                pair_value = pair_value * 27;
-            } else {
-                int val2 = (c2 == '.') ? 0 : (c2 - 'a' + 1);
-                pair_value = pair_value * 27 + val2;
-            }
+        if (pool->shutdown) {
+            pthread_mutex_unlock(&pool->mutex);
+            return NULL;
         }
+        seen = pool->generation;
+        pool_task_fn task = pool->task;
+        void* task_arg = pool->arg;
+        pthread_mutex_unlock(&pool->mutex);
         
-        hash = hash * count_BASE + pair_value;
+        task(task_arg, tid, pool->nthreads);
+        pool_barrier(pool);
+    }
+}
+
+void pool_start(WorkerPool* pool, int nthreads) {
+    pool->nthreads = nthreads;
+    pool->shutdown = 0;
+    pool->generation = 0;
+    pool->threads = (pthread_t*)counted_malloc(nthreads * sizeof(pthread_t));
+    if (pool->threads == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
     }
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pthread_barrier_init(&pool->barrier, NULL, nthreads);
     
-    return hash;
+    for (int i = 1; i < nthreads; i++) {
+        PoolWorkerArgs* args = (PoolWorkerArgs*)counted_malloc(sizeof(PoolWorkerArgs));
+        if (args == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        args->pool = pool;
+        args->tid = i;
+        if (pthread_create(&pool->threads[i], NULL, pool_worker, args) != 0) {
+            fprintf(stderr, "Error creating thread\n");
+            exit(1);
+        }
+    }
+    pool->started = 1;
 }
 
-// Convert ISO timestamp to Unix timestamp (unchanged)
-long long convert_timestamp(const char* timestamp) {
-    struct tm tm = {0};
-    sscanf(timestamp, "%4d-%2d-%2dT%2d:%2d:%2d",
-           &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
-           &tm.tm_hour, &tm.tm_min, &tm.tm_sec);
-    tm.tm_year -= 1900;
-    tm.tm_mon -= 1;
-    return (long long)mktime(&tm);
+// Run task on all workers and return once every worker has finished it
+void pool_run(WorkerPool* pool, pool_task_fn task, void* arg) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->task = task;
+    pool->arg = arg;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+    
+    task(arg, 0, pool->nthreads);
+    pool_barrier(pool);
 }
 
-// Get value for count sort based on sort column
-unsigned long long get_sort_value(FileRecord* record, char sort_by) {
-    switch (sort_by) {
-        case 'I': return (unsigned long long)record->id;
-        case 'T': return (unsigned long long)record->timestamp_val;
-        case 'N': return record->name_hash;
-        default: return 0;
+void pool_stop(WorkerPool* pool) {
+    if (!pool->started) return;
+    pthread_mutex_lock(&pool->mutex);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+    
+    for (int i = 1; i < pool->nthreads; i++) {
+        if (pthread_join(pool->threads[i], NULL) != 0) {
+            fprintf(stderr, "Error joining thread\n");
+        }
     }
+    pthread_barrier_destroy(&pool->barrier);
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->threads);
+    pool->started = 0;
 }
 
-// Thread function for counting elements in count sort
-void* count_count(void* arg) {
-    ThreadArgs* args = (ThreadArgs*)arg;
-    int count[count_BASE] = {0};
+// Thread count when -j is not given: $LAZYSORT_THREADS, else the CPUs this
+// process may run on according to its affinity mask
+int default_thread_count(void) {
+    const char* env = getenv("LAZYSORT_THREADS");
+    if (env != NULL && atoi(env) > 0) {
+        return atoi(env);
+    }
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0) {
+        return CPU_COUNT(&set);
+    }
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    return (online > 0) ? (int)online : 1;
+}
+
+// The sorters share one pool that is started on first use
+WorkerPool* get_sort_pool(void) {
+    if (!sort_pool.started) {
+        if (sort_threads <= 0) {
+            sort_threads = default_thread_count();
+        }
+        pool_start(&sort_pool, sort_threads);
+    }
+    return &sort_pool;
+}
+
+// Sort key for the 8 bytes of a name starting at depth: lowercased, big endian
+// and zero padded, so comparing keys compares the names case-insensitively and a
+// name that ends first sorts first. The key at depth 0 orders every name of up
+// to 8 characters exactly; longer names are refined by sort_name_items.
+unsigned long long name_chunk_key(const char* name, int name_len, int depth) {
+    unsigned long long key = 0;
+    for (int i = depth; i < depth + 8; i++) {
+        unsigned char c = (i < name_len) ? (unsigned char)tolower((unsigned char)name[i]) : 0;
+        key = (key << 8) | c;
+    }
+    return key;
+}
+
+// Compare two names case-insensitively from byte depth on, like strcasecmp
+int compare_names(const char* a, int a_len, const char* b, int b_len, int depth) {
+    int len = (a_len < b_len) ? a_len : b_len;
+    for (int i = depth; i < len; i++) {
+        int ca = tolower((unsigned char)a[i]);
+        int cb = tolower((unsigned char)b[i]);
+        if (ca != cb) return ca - cb;
+    }
+    return a_len - b_len;
+}
+
+// Days since 1970-01-01 of a proleptic Gregorian date (m in 1..12).
+// Out of range days simply carry into the next month, like mktime does.
+long long days_from_civil(long long y, int m, int d) {
+    y -= (m <= 2);
+    long long era = (y >= 0 ? y : y - 399) / 400;
+    long long yoe = y - era * 400;                                  // [0, 399]
+    long long doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1; // day of the March-based year
+    long long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;           // [0, 146096]
+    return era * 146097 + doe - 719468;
+}
+
+// Convert the TIMESTAMP_LEN bytes "YYYY-MM-DDTHH:MM:SS" at timestamp to Unix time,
+// always as UTC. Every byte is checked against the layout without branching, then
+// the fields are combined arithmetically, so no libc time functions (and no locks
+// or TZ lookups) are involved. Returns 0 on success, -1 if malformed.
+int convert_timestamp(const char* timestamp, long long* out) {
+    static const char layout[TIMESTAMP_LEN + 1] = "0000-00-00T00:00:00";
+    unsigned char digit[TIMESTAMP_LEN];
+    unsigned int bad = 0;
+    
+    for (int i = 0; i < TIMESTAMP_LEN; i++) {
+        digit[i] = (unsigned char)(timestamp[i] - '0');
+        bad |= (layout[i] == '0') ? (digit[i] > 9) : (timestamp[i] != layout[i]);
+    }
+    
+    int year = digit[0] * 1000 + digit[1] * 100 + digit[2] * 10 + digit[3];
+    int month = digit[5] * 10 + digit[6];
+    int day = digit[8] * 10 + digit[9];
+    int hour = digit[11] * 10 + digit[12];
+    int minute = digit[14] * 10 + digit[15];
+    int second = digit[17] * 10 + digit[18];
+    bad |= (month < 1) | (month > 12);
+    if (bad) return -1;
+    
+    *out = days_from_civil(year, month, day) * 86400LL + hour * 3600 + minute * 60 + second;
+    return 0;
+}
+
+void store_init(RecordStore* store, int n) {
+    store->n = n;
+    store->ids = (int*)counted_malloc(n * sizeof(int));
+    store->timestamp_vals = (long long*)counted_malloc(n * sizeof(long long));
+    store->name_keys = (unsigned long long*)counted_malloc(n * sizeof(unsigned long long));
+    store->name_offs = (size_t*)counted_malloc(n * sizeof(size_t));
+    store->name_lens = (unsigned int*)counted_malloc(n * sizeof(unsigned int));
+    store->timestamp_offs = (size_t*)counted_malloc(n * sizeof(size_t));
+    store->max_name_len = 0;
+    store->mapped = 0;
+    store->arena = NULL;
+    if (n > 0 && (store->ids == NULL || store->timestamp_vals == NULL || store->name_keys == NULL ||
+                  store->name_offs == NULL || store->name_lens == NULL || store->timestamp_offs == NULL)) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+}
+
+void store_free(RecordStore* store) {
+    if (store->mapped) return;
+    free(store->ids);
+    free(store->timestamp_vals);
+    free(store->name_keys);
+    free(store->name_offs);
+    free(store->name_lens);
+    free(store->timestamp_offs);
+}
+
+// Map the input file, or read all of stdin in READ_BLOCK_SIZE blocks when path is NULL.
+// Returns 0 on success.
+int load_input(const char* path, InputBuffer* in) {
+    in->data = NULL;
+    in->len = 0;
+    in->mapped = 0;
+    
+    if (path != NULL) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            perror(path);
+            return -1;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+        in->len = (size_t)st.st_size;
+        if (in->len > 0) {
+            void* data = mmap(NULL, in->len, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                perror(path);
+                close(fd);
+                return -1;
+            }
+            madvise(data, in->len, MADV_SEQUENTIAL);
+            in->data = (char*)data;
+            in->mapped = 1;
+        }
+        close(fd);
+        return 0;
+    }
     
-    // Count occurrences of each digit value
-    for (int i = args->start; i < args->end; i++) {
-        unsigned long long value = get_sort_value(&args->records[i], args->sort_by);
-        unsigned long long digit = (value / args->exp) % count_BASE;
-        count[digit]++;
+    size_t capacity = 0;
+    while (1) {
+        if (capacity - in->len < READ_BLOCK_SIZE) {
+            capacity = capacity ? capacity * 2 : 4 * READ_BLOCK_SIZE;
+            in->data = (char*)counted_realloc(in->data, capacity);
+            if (in->data == NULL) {
+                fprintf(stderr, "Memory allocation failed\n");
+                exit(1);
+            }
+        }
+        ssize_t got = read(STDIN_FILENO, in->data + in->len, capacity - in->len);
+        if (got < 0) {
+            perror("read");
+            return -1;
+        }
+        if (got == 0) break;
+        in->len += (size_t)got;
+    }
+    return 0;
+}
+
+void release_input(InputBuffer* in) {
+    if (in->mapped) {
+        munmap(in->data, in->len);
+    } else {
+        free(in->data);
+    }
+}
+
+int is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
+
+// Parse a decimal int at p (optional sign). Returns the position after it, or NULL.
+const char* parse_int(const char* p, const char* end, int* out) {
+    int negative = 0;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = (*p == '-');
+        p++;
     }
+    if (p == end || *p < '0' || *p > '9') return NULL;
+    long long value = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        value = value * 10 + (*p - '0');
+        if (value > (long long)INT_MAX + 1) return NULL;
+        p++;
+    }
+    if (negative) value = -value;
+    if (value > INT_MAX) return NULL;
+    *out = (int)value;
+    return p;
+}
+
+// Parse "<name> <id> <timestamp>" from line [p, end) into record i of the store.
+// Returns 0 on success.
+int parse_record(RecordStore* store, int i, const char* base, const char* p, const char* end) {
+    while (p < end && is_blank(*p)) p++;
+    const char* name = p;
+    while (p < end && !is_blank(*p)) p++;
+    int name_len = (int)(p - name);
+    if (name_len == 0) return -1;
+    
+    while (p < end && is_blank(*p)) p++;
+    int id;
+    p = parse_int(p, end, &id);
+    if (p == NULL || (p < end && !is_blank(*p))) return -1;
+    
+    while (p < end && is_blank(*p)) p++;
+    const char* timestamp = p;
+    while (p < end && !is_blank(*p)) p++;
+    if (p - timestamp != TIMESTAMP_LEN) return -1;
+    
+    store->ids[i] = id;
+    store->name_offs[i] = (size_t)(name - base);
+    store->name_lens[i] = (unsigned int)name_len;
+    store->name_keys[i] = name_chunk_key(name, name_len, 0);
+    store->timestamp_offs[i] = (size_t)(timestamp - base);
+    return convert_timestamp(timestamp, &store->timestamp_vals[i]);
+}
+
+typedef struct {
+    const char* data;
+    size_t begin;                // first byte after the record count line
+    size_t end;
+    RecordStore* store;
+    int* line_counts;            // non-blank lines starting in each worker's chunk
+    unsigned int* max_name_lens; // longest name each worker parsed
+    long long lines;             // total non-blank lines after the count line
+    size_t column_pos;           // start of line n, the sort column
+    int error_record;            // smallest record index that failed to parse, or n
+    pthread_mutex_t error_mutex;
+} ParseArgs;
+
+// Start of worker t's chunk of the record text: the split point moved forward to
+// just past the next newline, so that every line belongs to exactly one worker
+size_t parse_chunk_start(const ParseArgs* args, int t, int nthreads) {
+    if (t >= nthreads) return args->end;
+    size_t pos = args->begin + (size_t)((double)(args->end - args->begin) * t / nthreads);
+    if (t == 0) return args->begin;
+    while (pos < args->end && (pos == args->begin || args->data[pos - 1] != '\n')) pos++;
+    return pos;
+}
+
+// Pool task for parsing. Phase 1 counts the non-blank lines of every chunk, so
+// after the barrier each worker knows the record index of its first line, and
+// phase 2 parses straight into the store.
+void parse_thread(void* arg, int tid, int nthreads) {
+    ParseArgs* args = (ParseArgs*)arg;
+    WorkerPool* pool = &sort_pool;
+    const char* data = args->data;
+    size_t start = parse_chunk_start(args, tid, nthreads);
+    size_t stop = parse_chunk_start(args, tid + 1, nthreads);
     
-    // Calculate positions
-    int pos[count_BASE];
-    pos[0] = args->start;
-    for (int i = 1; i < count_BASE; i++) {
-        pos[i] = pos[i-1] + count[i-1];
+    int lines = 0;
+    for (size_t pos = start; pos < stop; ) {
+        const char* line_end = memchr(data + pos, '\n', args->end - pos);
+        size_t next = line_end ? (size_t)(line_end - data) + 1 : args->end;
+        for (size_t c = pos; c < next; c++) {
+            if (!is_blank(data[c])) {
+                lines++;
+                break;
+            }
+        }
+        pos = next;
     }
+    args->line_counts[tid] = lines;
+    pool_barrier(pool);
     
-    // Copy records to output array
-    for (int i = args->start; i < args->end; i++) {
-        unsigned long long value = get_sort_value(&args->records[i], args->sort_by);
-        unsigned long long digit = (value / args->exp) % count_BASE;
-        args->output[pos[digit]++] = args->records[i];
+    long long line = 0, total = 0;
+    for (int t = 0; t < nthreads; t++) {
+        if (t < tid) line += args->line_counts[t];
+        total += args->line_counts[t];
     }
+    if (tid == 0) args->lines = total;
     
-    return NULL;
+    // The store has room for store->n records; any line after those is the sort column
+    int n = args->store->n;
+    unsigned int max_name_len = 0;
+    for (size_t pos = start; pos < stop && line <= n; ) {
+        const char* line_end = memchr(data + pos, '\n', args->end - pos);
+        size_t next = line_end ? (size_t)(line_end - data) + 1 : args->end;
+        size_t c = pos;
+        while (c < next && is_blank(data[c])) c++;
+        if (c < next) {
+            if (line < n) {
+                if (parse_record(args->store, (int)line, data, data + c, data + next) != 0) {
+                    pthread_mutex_lock(&args->error_mutex);
+                    if (line < args->error_record) args->error_record = (int)line;
+                    pthread_mutex_unlock(&args->error_mutex);
+                } else if (args->store->name_lens[line] > max_name_len) {
+                    max_name_len = args->store->name_lens[line];
+                }
+            } else {
+                args->column_pos = c;
+            }
+            line++;
+        }
+        pos = next;
+    }
+    args->max_name_lens[tid] = max_name_len;
 }
 
-// Single-threaded count sort implementation
-void count_sort(FileRecord* records, int n, char sort_by) {
-    FileRecord* output = (FileRecord*)malloc(n * sizeof(FileRecord));
-    if (output == NULL) {
+// Parse the records in data[begin, end) into store, which has room for store->n
+// records, in parallel. Afterwards store->n is the number of records actually found.
+// Returns the index of the first record that failed to parse, or -1 if none did.
+// *column_pos is set to the start of the first line after the records, or to end if
+// there is none.
+int parse_records(const char* data, size_t begin, size_t end, RecordStore* store, size_t* column_pos) {
+    WorkerPool* pool = get_sort_pool();
+    ParseArgs args;
+    args.data = data;
+    args.begin = begin;
+    args.end = end;
+    args.store = store;
+    args.line_counts = (int*)counted_malloc(pool->nthreads * sizeof(int));
+    args.max_name_lens = (unsigned int*)counted_malloc(pool->nthreads * sizeof(unsigned int));
+    args.lines = 0;
+    args.column_pos = end;
+    args.error_record = store->n;
+    pthread_mutex_init(&args.error_mutex, NULL);
+    if (args.line_counts == NULL || args.max_name_lens == NULL) {
         fprintf(stderr, "Memory allocation failed\n");
         exit(1);
     }
+    pool_run(pool, parse_thread, &args);
+    for (int t = 0; t < pool->nthreads; t++) {
+        if (args.max_name_lens[t] > store->max_name_len) store->max_name_len = args.max_name_lens[t];
+    }
+    free(args.max_name_lens);
+    free(args.line_counts);
+    pthread_mutex_destroy(&args.error_mutex);
     
-    // Find maximum value to determine number of digits
-    unsigned long long max_val = 0;
-    for (int i = 0; i < n; i++) {
-        unsigned long long value = get_sort_value(&records[i], sort_by);
+    if (args.lines < store->n) {
+        store->n = (int)args.lines;
+    }
+    *column_pos = args.column_pos;
+    return (args.error_record < store->n) ? args.error_record : -1;
+}
+
+// Copy the sort column token starting at data[pos] into column (at most size - 1 bytes)
+void read_sort_column(const char* data, size_t pos, size_t end, char* column, int size) {
+    int len = 0;
+    for (size_t c = pos; c < end && !is_blank(data[c]) && len < size - 1; c++) {
+        column[len++] = data[c];
+    }
+    column[len] = '\0';
+}
+
+// Determine sort type
+char get_sort_by(const char* sort_column) {
+    if (strcmp(sort_column, "ID") == 0) return 'I';
+    if (strcmp(sort_column, "Timestamp") == 0) return 'T';
+    return 'N';
+}
+
+// Sort specification: one or more comma separated columns, e.g.
+// "Timestamp,ID,Name", compared in that order
+typedef struct {
+    int ncols;
+    char cols[MAX_SORT_COLUMNS];
+} SortSpec;
+
+// Returns 0 on success, -1 for an empty column or more than MAX_SORT_COLUMNS
+int parse_sort_spec(const char* text, SortSpec* spec) {
+    spec->ncols = 0;
+    char column[SORT_SPEC_LEN];
+    const char* p = text;
+    while (1) {
+        const char* comma = strchr(p, ',');
+        size_t len = (comma != NULL) ? (size_t)(comma - p) : strlen(p);
+        if (len == 0 || len >= sizeof(column) || spec->ncols == MAX_SORT_COLUMNS) return -1;
+        memcpy(column, p, len);
+        column[len] = '\0';
+        spec->cols[spec->ncols++] = get_sort_by(column);
+        if (comma == NULL) return 0;
+        p = comma + 1;
+    }
+}
+
+// Unsigned key of record i in one column; signed values get their sign bit
+// flipped so that unsigned order is numeric order
+unsigned long long column_key(const RecordStore* store, int i, char column) {
+    switch (column) {
+        case 'I': return (unsigned long long)(long long)store->ids[i] ^ (1ULL << 63);
+        case 'T': return (unsigned long long)store->timestamp_vals[i] ^ (1ULL << 63);
+        default: return store->name_keys[i];
+    }
+}
+
+// Key builders, one per sortable column, so the choice of column is made once per
+// call rather than once per element. Each fills items[lo, hi) with (key, index) pairs.
+#define DEFINE_KEY_BUILDER(column, key_expr)                                        \
+    void build_keys_##column(const RecordStore* store, SortItem* items, int lo, int hi) { \
+        for (int i = lo; i < hi; i++) {                                             \
+            items[i].key = (key_expr);                                              \
+            items[i].idx = (unsigned int)i;                                         \
+        }                                                                           \
+    }
+
+DEFINE_KEY_BUILDER(id, column_key(store, i, 'I'))
+DEFINE_KEY_BUILDER(timestamp, column_key(store, i, 'T'))
+DEFINE_KEY_BUILDER(name, column_key(store, i, 'N'))
+
+typedef void (*key_builder_fn)(const RecordStore* store, SortItem* items, int lo, int hi);
+
+typedef struct {
+    const RecordStore* store;
+    SortItem* items;
+    key_builder_fn build;
+} BuildKeysArgs;
+
+key_builder_fn get_key_builder(char sort_by) {
+    switch (sort_by) {
+        case 'I': return build_keys_id;
+        case 'T': return build_keys_timestamp;
+        default: return build_keys_name;
+    }
+}
+
+// Pool task: every worker builds the items of its own chunk
+void build_keys_thread(void* arg, int tid, int nthreads) {
+    BuildKeysArgs* args = (BuildKeysArgs*)arg;
+    int n = args->store->n;
+    args->build(args->store, args->items,
+                (int)((long long)tid * n / nthreads), (int)((long long)(tid + 1) * n / nthreads));
+}
+
+// Fill items with (sort key, record index) pairs for the sort column; the sorters only ever move these
+void build_sort_items(const RecordStore* store, SortItem* items, char sort_by) {
+    BuildKeysArgs args = { store, items, get_key_builder(sort_by) };
+    pool_run(get_sort_pool(), build_keys_thread, &args);
+}
+
+// Pool task for the parallel radix sort; every worker owns the chunk
+// [tid * n / nthreads, (tid + 1) * n / nthreads) and runs all passes.
+// Per pass, phase 1 builds a histogram of the chunk, the serial thread then turns the
+// nthreads x 2^digit_bits histograms into global exclusive offsets (bucket-major,
+// thread-minor, which keeps the pass stable), and phase 2 scatters the chunk.
+void count_count(void* arg, int tid, int nthreads) {
+    ThreadArgs* args = (ThreadArgs*)arg;
+    WorkerPool* pool = &sort_pool;
+    int start = (int)((long long)tid * args->n / nthreads);
+    int end = (int)((long long)(tid + 1) * args->n / nthreads);
+    int buckets = 1 << args->digit_bits;
+    unsigned long long mask = (unsigned long long)buckets - 1;
+    int* count = args->histograms + tid * buckets;
+    
+    // Find the key range; digits are taken from (key - min_val) so only
+    // the passes the range actually needs are run
+    unsigned long long min_val = ULLONG_MAX, max_val = 0;
+    for (int i = start; i < end; i++) {
+        unsigned long long value = args->items[i].key;
+        if (value < min_val) min_val = value;
         if (value > max_val) max_val = value;
     }
+    args->min_vals[tid] = min_val;
+    args->max_vals[tid] = max_val;
+    pool_barrier(pool);
+    for (int t = 0; t < nthreads; t++) {
+        if (args->min_vals[t] < min_val) min_val = args->min_vals[t];
+        if (args->max_vals[t] > max_val) max_val = args->max_vals[t];
+    }
+    int passes = 0;
+    for (unsigned long long range = (args->n > 0) ? max_val - min_val : 0; range > 0; range >>= args->digit_bits) {
+        passes++;
+    }
     
-    // Do counting sort for every digit
-    for (unsigned long long exp = 1; max_val/exp > 0; exp *= count_BASE) {
-        int count[count_BASE] = {0};
-        
+    // Do counting sort for every digit, alternating between the two buffers
+    SortItem* src = args->items;
+    SortItem* dst = args->output;
+    int shift = 0;
+    for (int pass = 0; pass < passes; pass++, shift += args->digit_bits) {
         // Count occurrences of each digit value
-        for (int i = 0; i < n; i++) {
-            unsigned long long value = get_sort_value(&records[i], sort_by);
-            unsigned long long digit = (value / exp) % count_BASE;
-            count[digit]++;
+        memset(count, 0, buckets * sizeof(int));
+        for (int i = start; i < end; i++) {
+            count[((src[i].key - min_val) >> shift) & mask]++;
         }
         
-        // Calculate positions
-        int pos[count_BASE];
-        pos[0] = 0;
-        for (int i = 1; i < count_BASE; i++) {
-            pos[i] = pos[i-1] + count[i-1];
+        // Global exclusive prefix sum across buckets x threads
+        if (pool_barrier(pool)) {
+            int sum = 0;
+            for (int d = 0; d < buckets; d++) {
+                for (int t = 0; t < nthreads; t++) {
+                    int c = args->histograms[t * buckets + d];
+                    args->histograms[t * buckets + d] = sum;
+                    sum += c;
+                }
+            }
         }
+        pool_barrier(pool);
         
-        // Copy records to output array
-        for (int i = 0; i < n; i++) {
-            unsigned long long value = get_sort_value(&records[i], sort_by);
-            unsigned long long digit = (value / exp) % count_BASE;
-            output[pos[digit]++] = records[i];
+        // Copy items to their global positions in the output array
+        for (int i = start; i < end; i++) {
+            dst[count[((src[i].key - min_val) >> shift) & mask]++] = src[i];
         }
+        // Every scatter must land before the next pass reads dst
+        pool_barrier(pool);
         
-        // Copy output back to records
-        memcpy(records, output, n * sizeof(FileRecord));
+        SortItem* tmp = src;
+        src = dst;
+        dst = tmp;
     }
     
-    free(output);
+    // Copy back to items if the last pass left the result in the scratch buffer
+    if (src != args->items) {
+        memcpy(args->items + start, src + start, (end - start) * sizeof(SortItem));
+    }
 }
 
-// Parallel count sort implementation
-void parallel_count_sort(FileRecord* records, int n, char sort_by) {
-    FileRecord* output = (FileRecord*)malloc(n * sizeof(FileRecord));
-    if (output == NULL) {
+// Single-threaded count sort implementation (LSD radix sort over digit_bits wide digits)
+void count_sort(SortItem* items, int n, int digit_bits) {
+    int buckets = 1 << digit_bits;
+    unsigned long long mask = (unsigned long long)buckets - 1;
+    SortItem* output = (SortItem*)counted_malloc(n * sizeof(SortItem));
+    int* count = (int*)counted_malloc(buckets * sizeof(int));
+    if ((output == NULL && n > 0) || count == NULL) {
         fprintf(stderr, "Memory allocation failed\n");
         exit(1);
     }
     
-    // Find maximum value to determine number of digits
-    unsigned long long max_val = 0;
+    // Find the key range to determine the number of digits
+    unsigned long long min_val = ULLONG_MAX, max_val = 0;
     for (int i = 0; i < n; i++) {
-        unsigned long long value = get_sort_value(&records[i], sort_by);
-        if (value > max_val) max_val = value;
+        if (items[i].key < min_val) min_val = items[i].key;
+        if (items[i].key > max_val) max_val = items[i].key;
     }
     
-    // Do counting sort for every digit
-    for (unsigned long long exp = 1; max_val/exp > 0; exp *= count_BASE) {
-        pthread_t threads[NUM_THREADS];
-        ThreadArgs thread_args[NUM_THREADS];
-        int chunk_size = n / NUM_THREADS;
+    // Do counting sort for every digit, alternating between the two buffers
+    SortItem* src = items;
+    SortItem* dst = output;
+    int shift = 0;
+    for (unsigned long long range = (n > 0) ? max_val - min_val : 0; range > 0; range >>= digit_bits, shift += digit_bits) {
+        // Count occurrences of each digit value
+        memset(count, 0, buckets * sizeof(int));
+        for (int i = 0; i < n; i++) {
+            count[((src[i].key - min_val) >> shift) & mask]++;
+        }
         
-        // Create threads for parallel counting
-        for (int i = 0; i < NUM_THREADS; i++) {
-            thread_args[i].records = records;
-            thread_args[i].output = output;
-            thread_args[i].start = i * chunk_size;
-            thread_args[i].end = (i == NUM_THREADS - 1) ? n : (i + 1) * chunk_size;
-            thread_args[i].exp = exp;
-            thread_args[i].sort_by = sort_by;
-            
-            if (pthread_create(&threads[i], NULL, count_count, &thread_args[i]) != 0) {
-                fprintf(stderr, "Error creating thread\n");
-                free(output);
-                exit(1);
-            }
+        // Calculate positions
+        int sum = 0;
+        for (int d = 0; d < buckets; d++) {
+            int c = count[d];
+            count[d] = sum;
+            sum += c;
         }
         
-        // Wait for all threads to complete
-        for (int i = 0; i < NUM_THREADS; i++) {
-            if (pthread_join(threads[i], NULL) != 0) {
-                fprintf(stderr, "Error joining thread\n");
-                free(output);
-                exit(1);
-            }
+        // Copy items to output array
+        for (int i = 0; i < n; i++) {
+            dst[count[((src[i].key - min_val) >> shift) & mask]++] = src[i];
         }
         
-        // Copy output back to records
-        memcpy(records, output, n * sizeof(FileRecord));
+        SortItem* tmp = src;
+        src = dst;
+        dst = tmp;
     }
     
+    if (src != items) {
+        memcpy(items, src, n * sizeof(SortItem));
+    }
+    free(count);
     free(output);
 }
 
-// Compare function for merge sort
-int compare_records(const FileRecord* a, const FileRecord* b, char sort_by) {
-    long long val_a, val_b;
-    
-    switch (sort_by) {
-        case 'I':
-            val_a = a->id;
-            val_b = b->id;
-            break;
-        case 'T':
-            val_a = a->timestamp_val;
-            val_b = b->timestamp_val;
-            break;
-        case 'N':
-            val_a = a->name_hash;
-            val_b = b->name_hash;
-            break;
-        default:
-            return 0;
+// Parallel count sort implementation (LSD radix sort over digit_bits wide digits)
+void parallel_count_sort(SortItem* items, int n, int digit_bits) {
+    WorkerPool* pool = get_sort_pool();
+    ThreadArgs args;
+    args.items = items;
+    args.output = (SortItem*)counted_malloc(n * sizeof(SortItem));
+    args.n = n;
+    args.digit_bits = digit_bits;
+    args.histograms = (int*)counted_malloc(((size_t)pool->nthreads << digit_bits) * sizeof(int));
+    args.min_vals = (unsigned long long*)counted_malloc(pool->nthreads * sizeof(unsigned long long));
+    args.max_vals = (unsigned long long*)counted_malloc(pool->nthreads * sizeof(unsigned long long));
+    if ((args.output == NULL && n > 0) || args.histograms == NULL || args.min_vals == NULL || args.max_vals == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
     }
     
-    if (val_a < val_b) return -1;
-    if (val_a > val_b) return 1;
-    return 0;
+    pool_run(pool, count_count, &args);
+    
+    free(args.max_vals);
+    free(args.min_vals);
+    free(args.histograms);
+    free(args.output);
 }
 
-// Merge function for merge sort
-void merge(FileRecord* records, int left, int mid, int right, char sort_by) {
-    int i, j, k;
-    int n1 = mid - left + 1;
-    int n2 = right - mid;
-    
-    FileRecord* L = (FileRecord*)malloc(n1 * sizeof(FileRecord));
-    FileRecord* R = (FileRecord*)malloc(n2 * sizeof(FileRecord));
-    
-    for (i = 0; i < n1; i++)
-        L[i] = records[left + i];
-    for (j = 0; j < n2; j++)
-        R[j] = records[mid + 1 + j];
+// Stable insertion sort of items[lo, hi), used for short runs
+void insertion_sort(SortItem* items, int lo, int hi) {
+    for (int i = lo + 1; i < hi; i++) {
+        SortItem key = items[i];
+        int j = i - 1;
+        while (j >= lo && items[j].key > key.key) {
+            items[j + 1] = items[j];
+            j--;
+        }
+        items[j + 1] = key;
+    }
+}
+
+// Merge src[lo, mid) and src[mid, hi) into dst[lo, hi)
+void merge(const SortItem* src, SortItem* dst, int lo, int mid, int hi) {
+    int i = lo, j = mid, k = lo;
     
-    i = 0;
-    j = 0;
-    k = left;
+    // Runs that are already in order (common on presorted input) are just copied
+    if (mid > lo && hi > mid && src[mid - 1].key <= src[mid].key) {
+        memcpy(dst + lo, src + lo, (hi - lo) * sizeof(SortItem));
+        return;
+    }
     
-    while (i < n1 && j < n2) {
-        if (compare_records(&L[i], &R[j], sort_by) <= 0)
-            records[k++] = L[i++];
+    while (i < mid && j < hi) {
+        if (src[i].key <= src[j].key)
+            dst[k++] = src[i++];
         else
-            records[k++] = R[j++];
+            dst[k++] = src[j++];
     }
     
-    while (i < n1)
-        records[k++] = L[i++];
-    while (j < n2)
-        records[k++] = R[j++];
-    
-    free(L);
-    free(R);
+    while (i < mid)
+        dst[k++] = src[i++];
+    while (j < hi)
+        dst[k++] = src[j++];
 }
 
-// Sequential merge sort
-void merge_sort_sequential(FileRecord* records, int left, int right, char sort_by) {
-    if (left < right) {
-        int mid = left + (right - left) / 2;
-        merge_sort_sequential(records, left, mid, sort_by);
-        merge_sort_sequential(records, mid + 1, right, sort_by);
-        merge(records, left, mid, right, sort_by);
+// Sequential merge sort of items[lo, hi) that never allocates: the halves are
+// sorted into the opposite buffer and merged back, so items and aux swap roles
+// at every level. The result ends up in aux[lo, hi) if to_aux is set, else in items.
+void merge_sort_sequential(SortItem* items, SortItem* aux, int lo, int hi, int to_aux) {
+    if (hi - lo <= INSERTION_SORT_CUTOFF) {
+        insertion_sort(items, lo, hi);
+        if (to_aux) {
+            memcpy(aux + lo, items + lo, (hi - lo) * sizeof(SortItem));
+        }
+        return;
+    }
+    int mid = lo + (hi - lo) / 2;
+    merge_sort_sequential(items, aux, lo, mid, !to_aux);
+    merge_sort_sequential(items, aux, mid, hi, !to_aux);
+    if (to_aux) {
+        merge(items, aux, lo, mid, hi);
+    } else {
+        merge(aux, items, lo, mid, hi);
     }
 }
 
-// Thread function for merge sort
-void* merge_sort_thread(void* arg) {
-    MergeSortArgs* args = (MergeSortArgs*)arg;
-    merge_sort_sequential(args->records, args->start, args->end, args->sort_by);
-    return NULL;
+// Co-rank for merge path partitioning: returns how many elements of A are among
+// the first k outputs of the stable merge of A and B (ties are taken from A first)
+int merge_co_rank(int k, const SortItem* A, int la, const SortItem* B, int lb) {
+    int lo = (k > lb) ? k - lb : 0;
+    int hi = (k < la) ? k : la;
+    while (1) {
+        int i = lo + (hi - lo) / 2;
+        int j = k - i;
+        if (i > 0 && j < lb && A[i - 1].key > B[j].key) {
+            hi = i - 1;
+        } else if (j > 0 && i < la && B[j - 1].key >= A[i].key) {
+            lo = i + 1;
+        } else {
+            return i;
+        }
+    }
 }
 
-// Parallel merge sort implementation
-void parallel_merge_sort(FileRecord* records, int n, char sort_by) {
-    pthread_t threads[NUM_THREADS];
-    MergeSortArgs thread_args[NUM_THREADS];
-    int chunk_size = n / NUM_THREADS;
+// Write outputs [k0, k1) of the stable merge of A and B to out[k0 .. k1)
+void merge_path_range(const SortItem* A, int la, const SortItem* B, int lb,
+                      SortItem* out, int k0, int k1) {
+    int i = merge_co_rank(k0, A, la, B, lb);
+    int j = k0 - i;
+    int i_end = merge_co_rank(k1, A, la, B, lb);
+    int j_end = k1 - i_end;
+    int k = k0;
     
-    // Create threads for initial parallel sorting
-    for (int i = 0; i < NUM_THREADS; i++) {
-        thread_args[i].records = records;
-        thread_args[i].start = i * chunk_size;
-        thread_args[i].end = (i == NUM_THREADS - 1) ? n - 1 : (i + 1) * chunk_size - 1;
-        thread_args[i].sort_by = sort_by;
-        
-        pthread_create(&threads[i], NULL, merge_sort_thread, &thread_args[i]);
+    while (i < i_end && j < j_end) {
+        if (A[i].key <= B[j].key)
+            out[k++] = A[i++];
+        else
+            out[k++] = B[j++];
     }
-    
-    // Wait for all threads to complete
-    for (int i = 0; i < NUM_THREADS; i++) {
-        pthread_join(threads[i], NULL);
+    while (i < i_end)
+        out[k++] = A[i++];
+    while (j < j_end)
+        out[k++] = B[j++];
+}
+
+// Chunk c of n items split across nthreads workers spans [chunk_start(c), chunk_start(c + 1))
+int chunk_start(int c, int n, int nthreads) {
+    if (c > nthreads) c = nthreads;
+    return (int)((long long)c * n / nthreads);
+}
+
+// Parallel merge sort as fork/join tasks on a work-stealing scheduler. A sort task
+// over more than grain items forks its two halves; the worker keeps descending
+// into the left half and leaves the right one in its deque for idle workers to
+// steal. Whoever finishes the last half merges them, splitting the merge into
+// grain sized merge path slices that are forked the same way, so that even the
+// final O(n) merge is spread over every worker.
+typedef struct ForkJoinTask ForkJoinTask;
+struct ForkJoinTask {
+    int lo, mid, hi;
+    int to_aux;                  // sort node: result goes to aux instead of items
+    int k0, k1;                  // merge slice: outputs [k0, k1) of its node's merge
+    int is_slice;
+    int merging;                 // sort node: children are done, pending counts slices
+    atomic_int pending;          // outstanding children or slices
+    ForkJoinTask* parent;
+};
+
+// Per-worker deque. The owner pushes and pops at the tail, thieves take from the head.
+typedef struct {
+    ForkJoinTask** tasks;
+    int head;
+    int tail;
+    pthread_mutex_t mutex;
+} TaskDeque;
+
+typedef struct {
+    SortItem* items;
+    SortItem* aux;
+    int n;
+    int grain;
+    ForkJoinTask* task_arena;    // every task of the sort, handed out by bumping task_count
+    atomic_int task_count;
+    int task_capacity;
+    TaskDeque* deques;
+    atomic_int done;
+} ForkJoinSort;
+
+ForkJoinTask* fork_join_new_task(ForkJoinSort* fj) {
+    int slot = atomic_fetch_add(&fj->task_count, 1);
+    if (slot >= fj->task_capacity) {
+        fprintf(stderr, "Fork/join task arena exhausted\n");
+        exit(1);
     }
-    
-    // Merge the sorted chunks
-    for (int size = chunk_size; size < n; size = size * 2) {
-        for (int left = 0; left < n; left += 2 * size) {
-            int mid = left + size - 1;
-            int right = (left + 2 * size - 1 < n - 1) ? left + 2 * size - 1 : n - 1;
-            if (mid < right) {
-                merge(records, left, mid, right, sort_by);
+    ForkJoinTask* task = &fj->task_arena[slot];
+    memset(task, 0, sizeof(*task));
+    return task;
+}
+
+void deque_push(TaskDeque* deque, ForkJoinTask* task) {
+    pthread_mutex_lock(&deque->mutex);
+    deque->tasks[deque->tail++] = task;
+    pthread_mutex_unlock(&deque->mutex);
+}
+
+ForkJoinTask* deque_pop(TaskDeque* deque) {
+    ForkJoinTask* task = NULL;
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->tail > deque->head) {
+        task = deque->tasks[--deque->tail];
+    }
+    if (deque->tail == deque->head) {
+        deque->head = deque->tail = 0;
+    }
+    pthread_mutex_unlock(&deque->mutex);
+    return task;
+}
+
+ForkJoinTask* deque_steal(TaskDeque* deque) {
+    ForkJoinTask* task = NULL;
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->tail > deque->head) {
+        task = deque->tasks[deque->head++];
+    }
+    pthread_mutex_unlock(&deque->mutex);
+    return task;
+}
+
+// Run merge slice task: its outputs of the merge of the node's two sorted halves
+void fork_join_merge_slice(ForkJoinSort* fj, ForkJoinTask* slice) {
+    ForkJoinTask* node = slice->parent;
+    const SortItem* src = node->to_aux ? fj->items : fj->aux;
+    SortItem* dst = node->to_aux ? fj->aux : fj->items;
+    merge_path_range(src + node->lo, node->mid - node->lo, src + node->mid, node->hi - node->mid,
+                     dst + node->lo, slice->k0, slice->k1);
+}
+
+// Report task as finished and walk up the tree for as long as this was the last
+// outstanding child: a node whose halves are sorted starts its merge, a node
+// whose merge slices are all written is itself finished.
+void fork_join_finish(ForkJoinSort* fj, ForkJoinTask* task, int tid) {
+    while (1) {
+        ForkJoinTask* node = task->parent;
+        if (node == NULL) {
+            atomic_store(&fj->done, 1);
+            return;
+        }
+        if (atomic_fetch_sub(&node->pending, 1) != 1) return;
+        if (node->merging) {
+            task = node;
+            continue;
+        }
+        
+        // Both halves are sorted: fork the merge slices, run the first one here
+        node->merging = 1;
+        int size = node->hi - node->lo;
+        int slices = (size + fj->grain - 1) / fj->grain;
+        atomic_store(&node->pending, slices);
+        ForkJoinTask* first = NULL;
+        for (int s = slices - 1; s >= 0; s--) {
+            ForkJoinTask* slice = fork_join_new_task(fj);
+            slice->is_slice = 1;
+            slice->parent = node;
+            slice->k0 = (int)((long long)s * size / slices);
+            slice->k1 = (int)((long long)(s + 1) * size / slices);
+            if (s == 0) {
+                first = slice;
+            } else {
+                deque_push(&fj->deques[tid], slice);
             }
         }
+        fork_join_merge_slice(fj, first);
+        task = first;
     }
 }
 
-int main() {
-    int n;
-    if (scanf("%d", &n) != 1) {
-        fprintf(stderr, "Invalid input for number of records\n");
-        return 1;
-    }
-    
-    FileRecord* records = (FileRecord*)malloc(n * sizeof(FileRecord));
-    if (records == NULL) {
-        fprintf(stderr, "Memory allocation failed\n");
-        return 1;
+// Run a sort task: fork down to the grain size, then sort sequentially
+void fork_join_sort_node(ForkJoinSort* fj, ForkJoinTask* task, int tid) {
+    while (task->hi - task->lo > fj->grain) {
+        task->mid = task->lo + (task->hi - task->lo) / 2;
+        ForkJoinTask* left = fork_join_new_task(fj);
+        ForkJoinTask* right = fork_join_new_task(fj);
+        left->lo = task->lo;
+        left->hi = task->mid;
+        right->lo = task->mid;
+        right->hi = task->hi;
+        left->to_aux = right->to_aux = !task->to_aux;
+        left->parent = right->parent = task;
+        atomic_store(&task->pending, 2);
+        deque_push(&fj->deques[tid], right);
+        task = left;
     }
-    
-    // Read input
-    for (int i = 0; i < n; i++) {
-        if (scanf("%s %d %s", records[i].name, &records[i].id, records[i].timestamp) != 3) {
-            fprintf(stderr, "Invalid input for record %d\n", i);
-            free(records);
-            return 1;
+    merge_sort_sequential(fj->items, fj->aux, task->lo, task->hi, task->to_aux);
+    fork_join_finish(fj, task, tid);
+}
+
+// Pool task: every worker runs tasks from its own deque, steals from the others
+// when it runs dry, and stops once the root task has finished
+void fork_join_worker(void* arg, int tid, int nthreads) {
+    ForkJoinSort* fj = (ForkJoinSort*)arg;
+    int victim = tid;
+    while (!atomic_load(&fj->done)) {
+        ForkJoinTask* task = deque_pop(&fj->deques[tid]);
+        for (int tries = 1; task == NULL && tries < nthreads; tries++) {
+            victim = (victim + 1) % nthreads;
+            if (victim != tid) task = deque_steal(&fj->deques[victim]);
         }
-        if (strlen(records[i].name)!=MAX_FILENAME-1){
-            int len= strlen(records[i].name);
-            for (int j=len;j<MAX_FILENAME;j++){
-                records[i].name[j]=' ';
-            }
-            records[i].name[MAX_FILENAME]='\0';
+        if (task == NULL) {
+            sched_yield();
+            continue;
+        }
+        if (task->is_slice) {
+            fork_join_merge_slice(fj, task);
+            fork_join_finish(fj, task, tid);
+        } else {
+            fork_join_sort_node(fj, task, tid);
         }
-        records[i].name_hash = calculate_name_hash(records[i].name);
-        records[i].timestamp_val = convert_timestamp(records[i].timestamp);
     }
+}
+
+// Parallel merge sort implementation. Peak extra memory is exactly one copy of
+// the items (aux) plus the task arena, whose size is set by n / FORK_JOIN_GRAIN.
+void parallel_merge_sort(SortItem* items, int n) {
+    WorkerPool* pool = get_sort_pool();
+    ForkJoinSort fj;
+    fj.items = items;
+    fj.n = n;
+    fj.grain = FORK_JOIN_GRAIN;
+    atomic_init(&fj.task_count, 0);
+    atomic_init(&fj.done, 0);
     
-    char sort_column[10];
-    if (scanf("%s", sort_column) != 1) {
-        fprintf(stderr, "Invalid input for sort column\n");
-        free(records);
-        return 1;
+    // Sort nodes form a binary tree over ceil(n / grain) leaves, and every tree
+    // level has at most n / grain + (nodes on the level) merge slices
+    long long leaves = (n + fj.grain - 1) / fj.grain + 1;
+    int depth = 1;
+    for (long long width = 1; width < leaves; width *= 2) {
+        depth++;
     }
+    fj.task_capacity = (int)(4 * leaves + depth * (leaves + 1));
     
-    // Determine sort type
-    char sort_by;
-    if (strcmp(sort_column, "ID") == 0) sort_by = 'I';
-    else if (strcmp(sort_column, "Timestamp") == 0) sort_by = 'T';
-    else sort_by = 'N';
-    
-    // Choose sorting algorithm based on number of records
-    if (n < THRESHOLD) {
-        parallel_count_sort(records, n, sort_by);
-    } else {
-        parallel_merge_sort(records, n, sort_by);
+    fj.aux = (SortItem*)counted_malloc(n * sizeof(SortItem));
+    fj.task_arena = (ForkJoinTask*)counted_malloc(fj.task_capacity * sizeof(ForkJoinTask));
+    fj.deques = (TaskDeque*)counted_malloc(pool->nthreads * sizeof(TaskDeque));
+    if ((fj.aux == NULL && n > 0) || fj.task_arena == NULL || fj.deques == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
     }
-    
-    // Print sorted records
-    printf("%s\n", sort_column);
-    for (int i = 0; i < n; i++) {
-        printf("%s \t%d\t\t%s\n", records[i].name, records[i].id, records[i].timestamp);
+    for (int t = 0; t < pool->nthreads; t++) {
+        fj.deques[t].tasks = (ForkJoinTask**)counted_malloc(fj.task_capacity * sizeof(ForkJoinTask*));
+        if (fj.deques[t].tasks == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        fj.deques[t].head = fj.deques[t].tail = 0;
+        pthread_mutex_init(&fj.deques[t].mutex, NULL);
     }
     
-    free(records);
-    return 0;
-}
\ No newline at end of file
+    ForkJoinTask* root = fork_join_new_task(&fj);
+    root->lo = 0;
+    root->hi = n;
+    deque_push(&fj.deques[0], root);
+    pool_run(pool, fork_join_worker, &fj);
+    
+    for (int t = 0; t < pool->nthreads; t++) {
+        pthread_mutex_destroy(&fj.deques[t].mutex);
+        free(fj.deques[t].tasks);
+    }
+    free(fj.deques);
+    free(fj.task_arena);
+    free(fj.aux);
+}
+
+// Parallel sample sort: splitters drawn from a sample cut the key space into
+// buckets, every worker partitions its chunk into all buckets in one scatter,
+// and the buckets are then sorted independently, each within its own range of
+// the output. Apart from the local sorts the data crosses memory twice: once to
+// classify and once to scatter. Items are ordered by (key, position) while
+// splitting, so equal keys spread over buckets without losing stability.
+typedef struct {
+    SortItem* items;
+    SortItem* aux;
+    int n;
+    int nbuckets;
+    const unsigned long long* splitter_keys;  // nbuckets - 1 splitters, ascending
+    const int* splitter_pos;                  // position of each splitter in items
+    unsigned short* bucket_of;   // bucket of every item, from the classify pass
+    int* histograms;             // nthreads x nbuckets, turned into write offsets
+    int* bucket_start;           // nbuckets + 1 bucket boundaries
+    atomic_int next_bucket;      // next bucket to be claimed for its local sort
+} SampleSortArgs;
+
+// Bucket of the item at pos: the number of the ascending splitters at or
+// before (key, pos)
+int splitter_bucket(const unsigned long long* splitter_keys, const int* splitter_pos, int nsplitters,
+                    unsigned long long key, int pos) {
+    int lo = 0;
+    int hi = nsplitters;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        unsigned long long split = splitter_keys[mid];
+        if (split < key || (split == key && splitter_pos[mid] <= pos)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+int sample_bucket(const SampleSortArgs* args, unsigned long long key, int pos) {
+    return splitter_bucket(args->splitter_keys, args->splitter_pos, args->nbuckets - 1, key, pos);
+}
+
+// Pool task for sample sort
+void sample_sort_thread(void* arg, int tid, int nthreads) {
+    SampleSortArgs* args = (SampleSortArgs*)arg;
+    WorkerPool* pool = &sort_pool;
+    int start = chunk_start(tid, args->n, nthreads);
+    int end = chunk_start(tid + 1, args->n, nthreads);
+    int nbuckets = args->nbuckets;
+    int* count = args->histograms + tid * nbuckets;
+    
+    // Classify the chunk once, remembering every item's bucket for the scatter
+    for (int i = start; i < end; i++) {
+        int b = sample_bucket(args, args->items[i].key, i);
+        args->bucket_of[i] = (unsigned short)b;
+        count[b]++;
+    }
+    
+    // Global exclusive prefix sum across buckets x threads
+    if (pool_barrier(pool)) {
+        int sum = 0;
+        for (int b = 0; b < nbuckets; b++) {
+            args->bucket_start[b] = sum;
+            for (int t = 0; t < nthreads; t++) {
+                int c = args->histograms[t * nbuckets + b];
+                args->histograms[t * nbuckets + b] = sum;
+                sum += c;
+            }
+        }
+        args->bucket_start[nbuckets] = sum;
+    }
+    pool_barrier(pool);
+    
+    // Chunks scatter in thread order, so each bucket keeps the input order
+    for (int i = start; i < end; i++) {
+        args->aux[count[args->bucket_of[i]]++] = args->items[i];
+    }
+    pool_barrier(pool);
+    
+    // Sort the buckets back into items; there are several per worker so that
+    // uneven buckets still balance out
+    int b;
+    while ((b = atomic_fetch_add(&args->next_bucket, 1)) < nbuckets) {
+        merge_sort_sequential(args->aux, args->items, args->bucket_start[b], args->bucket_start[b + 1], 1);
+    }
+}
+
+// Sample sort implementation. Extra memory is one copy of the items (aux) and
+// a two byte bucket number per item.
+void parallel_sample_sort(SortItem* items, int n) {
+    WorkerPool* pool = get_sort_pool();
+    int nthreads = pool->nthreads;
+    int nbuckets = nthreads * SAMPLE_SORT_BUCKETS_PER_THREAD;
+    if (nbuckets > USHRT_MAX) nbuckets = USHRT_MAX;
+    int samples = nbuckets * SAMPLE_SORT_OVERSAMPLE;
+    if (samples > n) samples = n;
+    
+    SortItem* sample = (SortItem*)counted_malloc(samples * 2 * sizeof(SortItem));
+    unsigned long long* splitter_keys = (unsigned long long*)counted_malloc(nbuckets * sizeof(unsigned long long));
+    int* splitter_pos = (int*)counted_malloc(nbuckets * sizeof(int));
+    SampleSortArgs args;
+    args.aux = (SortItem*)counted_malloc(n * sizeof(SortItem));
+    args.bucket_of = (unsigned short*)counted_malloc(n * sizeof(unsigned short));
+    args.histograms = (int*)counted_calloc(nthreads * nbuckets, sizeof(int));
+    args.bucket_start = (int*)counted_malloc((nbuckets + 1) * sizeof(int));
+    if (sample == NULL || splitter_keys == NULL || splitter_pos == NULL || args.aux == NULL ||
+        args.bucket_of == NULL || args.histograms == NULL || args.bucket_start == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    
+    // Evenly spaced sample; idx holds the position, and since the positions
+    // ascend a stable sort by key orders the sample by (key, position)
+    for (int s = 0; s < samples; s++) {
+        int pos = (int)(((long long)s * n + n / 2) / samples);
+        sample[s].key = items[pos].key;
+        sample[s].idx = (unsigned int)pos;
+    }
+    merge_sort_sequential(sample, sample + samples, 0, samples, 0);
+    for (int b = 0; b < nbuckets - 1; b++) {
+        const SortItem* split = &sample[(long long)(b + 1) * samples / nbuckets];
+        splitter_keys[b] = split->key;
+        splitter_pos[b] = (int)split->idx;
+    }
+    
+    args.items = items;
+    args.n = n;
+    args.nbuckets = nbuckets;
+    args.splitter_keys = splitter_keys;
+    args.splitter_pos = splitter_pos;
+    atomic_init(&args.next_bucket, 0);
+    pool_run(pool, sample_sort_thread, &args);
+    
+    free(args.bucket_start);
+    free(args.histograms);
+    free(args.bucket_of);
+    free(args.aux);
+    free(splitter_pos);
+    free(splitter_keys);
+    free(sample);
+}
+
+// Per-machine costs the engine selector works from. All are for one thread.
+typedef struct {
+    int threads;                 // pool size the profile was measured with
+    double radix_ns[3];          // per item per radix pass, for each of radix_widths
+    double prefix_ns;            // per bucket of the serial prefix sum
+    double merge_ns;             // per item per merge level
+    double dispatch_ns;          // one pool_run or barrier round trip
+    int loaded;
+} CostProfile;
+
+static const int radix_widths[3] = { 8, 11, 16 };
+CostProfile cost_profile;
+char forced_engine = 0;          // --bench: the only engine plan_sort may pick, 0 for any
+
+typedef struct {
+    char engine;                 // 'n' already sorted, 's' sequential, 'r' radix, 'm' merge, 'p' sample sort
+    int digit_bits;              // for 'r'
+} SortPlan;
+
+double elapsed_ns(const struct timespec* since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1e9 + (now.tv_nsec - since->tv_nsec);
+}
+
+void empty_task(void* arg, int tid, int nthreads) {
+    (void)arg;
+    (void)tid;
+    (void)nthreads;
+}
+
+// Merge levels of a merge sort of n items, counting the insertion sorted runs as one
+int merge_levels(int n) {
+    int levels = 1;
+    for (long long run = INSERTION_SORT_CUTOFF; run < n; run *= 2) {
+        levels++;
+    }
+    return levels;
+}
+
+// Startup microbenchmark, a few milliseconds on CALIBRATION_ITEMS random keys
+void calibrate_costs(CostProfile* profile) {
+    int n = CALIBRATION_ITEMS;
+    SortItem* items = (SortItem*)counted_malloc(n * sizeof(SortItem));
+    SortItem* aux = (SortItem*)counted_malloc(n * sizeof(SortItem));
+    int* prefix = (int*)counted_calloc(1 << 16, sizeof(int));
+    if (items == NULL || aux == NULL || prefix == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    unsigned long long state = 0x9E3779B97F4A7C15ULL;
+    struct timespec start;
+    
+    // One radix pass per width: keys are kept inside a single digit.
+    // A first untimed sort faults in the scratch memory.
+    for (int i = 0; i < n; i++) {
+        items[i].key = (unsigned long long)i;
+        items[i].idx = (unsigned int)i;
+    }
+    count_sort(items, n, 16);
+    for (int w = 0; w < 3; w++) {
+        unsigned long long mask = (1ULL << radix_widths[w]) - 1;
+        for (int i = 0; i < n; i++) {
+            state ^= state << 13; state ^= state >> 7; state ^= state << 17;
+            items[i].key = state & mask;
+            items[i].idx = (unsigned int)i;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        count_sort(items, n, radix_widths[w]);
+        profile->radix_ns[w] = elapsed_ns(&start) / n;
+    }
+    
+    // The second round runs on warm memory
+    for (int round = 0; round < 2; round++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int sum = 0;
+        for (int d = 0; d < (1 << 16); d++) {
+            int c = prefix[d];
+            prefix[d] = sum;
+            sum += c;
+        }
+        profile->prefix_ns = elapsed_ns(&start) / (1 << 16);
+    }
+    
+    for (int i = 0; i < n; i++) {
+        state ^= state << 13; state ^= state >> 7; state ^= state << 17;
+        items[i].key = state;
+        items[i].idx = (unsigned int)i;
+    }
+    memcpy(aux, items, n * sizeof(SortItem));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    merge_sort_sequential(items, aux, 0, n, 0);
+    profile->merge_ns = elapsed_ns(&start) / ((double)n * merge_levels(n));
+    
+    WorkerPool* pool = get_sort_pool();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int r = 0; r < 64; r++) {
+        pool_run(pool, empty_task, NULL);
+    }
+    profile->dispatch_ns = elapsed_ns(&start) / 64;
+    profile->threads = pool->nthreads;
+    
+    free(prefix);
+    free(aux);
+    free(items);
+}
+
+// Profile cache: $LAZYSORT_PROFILE, else ~/.lazysort_profile
+int get_profile_path(char* path, size_t size) {
+    const char* env = getenv("LAZYSORT_PROFILE");
+    if (env != NULL) {
+        snprintf(path, size, "%s", env);
+        return 0;
+    }
+    const char* home = getenv("HOME");
+    if (home == NULL) return -1;
+    snprintf(path, size, "%s/.lazysort_profile", home);
+    return 0;
+}
+
+int load_cost_profile(CostProfile* profile, const char* path) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) return -1;
+    int fields = fscanf(file, "threads %d radix8 %lf radix11 %lf radix16 %lf prefix %lf merge %lf dispatch %lf",
+                        &profile->threads, &profile->radix_ns[0], &profile->radix_ns[1], &profile->radix_ns[2],
+                        &profile->prefix_ns, &profile->merge_ns, &profile->dispatch_ns);
+    fclose(file);
+    return (fields == 7) ? 0 : -1;
+}
+
+void save_cost_profile(const CostProfile* profile, const char* path) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) return;
+    fprintf(file, "threads %d\nradix8 %.4f\nradix11 %.4f\nradix16 %.4f\nprefix %.4f\nmerge %.4f\ndispatch %.1f\n",
+            profile->threads, profile->radix_ns[0], profile->radix_ns[1], profile->radix_ns[2],
+            profile->prefix_ns, profile->merge_ns, profile->dispatch_ns);
+    fclose(file);
+}
+
+// Load the cached profile, or calibrate (and cache) when there is none, it was
+// measured with a different pool size, or force is set
+CostProfile* get_cost_profile(int force) {
+    if (cost_profile.loaded && !force) return &cost_profile;
+    char path[PATH_MAX];
+    int have_path = (get_profile_path(path, sizeof(path)) == 0);
+    if (force || !have_path || load_cost_profile(&cost_profile, path) != 0 ||
+        cost_profile.threads != get_sort_pool()->nthreads) {
+        calibrate_costs(&cost_profile);
+        if (have_path) save_cost_profile(&cost_profile, path);
+    }
+    cost_profile.loaded = 1;
+    return &cost_profile;
+}
+
+typedef struct {
+    const SortItem* items;
+    int n;
+    int* unsorted;               // one flag per worker
+} SortedCheckArgs;
+
+// Pool task: does the worker's chunk (and the step into the next chunk) ascend?
+void sorted_check_thread(void* arg, int tid, int nthreads) {
+    SortedCheckArgs* args = (SortedCheckArgs*)arg;
+    int lo = chunk_start(tid, args->n, nthreads);
+    int hi = chunk_start(tid + 1, args->n, nthreads);
+    if (hi < args->n) hi++;
+    int unsorted = 0;
+    for (int i = lo + 1; i < hi; i++) {
+        unsorted |= (args->items[i - 1].key > args->items[i].key);
+    }
+    args->unsorted[tid] = unsorted;
+}
+
+int items_sorted(const SortItem* items, int n) {
+    WorkerPool* pool = get_sort_pool();
+    int unsorted[pool->nthreads];
+    SortedCheckArgs args = { items, n, unsorted };
+    pool_run(pool, sorted_check_thread, &args);
+    for (int t = 0; t < pool->nthreads; t++) {
+        if (unsorted[t]) return 0;
+    }
+    return 1;
+}
+
+// Pick the engine with the lowest estimated cost for these items. A sample gives
+// the key range, and with it the number of radix passes for each digit width, and
+// the fraction of sampled neighbours already in order, which discounts merging.
+SortPlan plan_sort(const SortItem* items, int n) {
+    SortPlan plan = { 's', 0 };
+    if (n <= SMALL_SORT_MAX || forced_engine == 's') return plan;
+    
+    CostProfile* cost = get_cost_profile(0);
+    int threads = get_sort_pool()->nthreads;
+    int samples = (n < SAMPLE_SIZE) ? n : SAMPLE_SIZE;
+    unsigned long long min_key = ULLONG_MAX, max_key = 0, prev = 0;
+    int ordered = 0;
+    for (int s = 0; s < samples; s++) {
+        unsigned long long key = items[(long long)s * n / samples].key;
+        if (key < min_key) min_key = key;
+        if (key > max_key) max_key = key;
+        if (s > 0 && prev <= key) ordered++;
+        prev = key;
+    }
+    double sortedness = (double)ordered / (samples - 1);
+    if (forced_engine == 0 && ordered == samples - 1 && items_sorted(items, n)) {
+        plan.engine = 'n';
+        return plan;
+    }
+    
+    int range_bits = 0;
+    for (unsigned long long range = max_key - min_key; range > 0; range >>= 1) {
+        range_bits++;
+    }
+    
+    double merge_work = (double)n * merge_levels(n) * cost->merge_ns * (1.0 - 0.5 * sortedness);
+    double best = (forced_engine == 0) ? merge_work : DBL_MAX;
+    
+    double merge_cost = merge_work / threads + (n / FORK_JOIN_GRAIN + 2) * cost->dispatch_ns;
+    if ((forced_engine == 0 || forced_engine == 'm') && merge_cost < best) {
+        best = merge_cost;
+        plan.engine = 'm';
+    }
+    
+    // Classify and scatter cost about one 8 bit radix pass each, after which
+    // every bucket is merge sorted on its own
+    int buckets = threads * SAMPLE_SORT_BUCKETS_PER_THREAD;
+    double sample_cost = 2.0 * n * cost->radix_ns[0] / threads +
+                         (double)n * merge_levels(n / buckets) * cost->merge_ns * (1.0 - 0.5 * sortedness) / threads +
+                         2 * cost->dispatch_ns;
+    if ((forced_engine == 0 || forced_engine == 'p') && sample_cost < best) {
+        best = sample_cost;
+        plan.engine = 'p';
+    }
+    
+    for (int w = 0; w < 3; w++) {
+        int passes = (range_bits + radix_widths[w] - 1) / radix_widths[w];
+        double pass_cost = (double)n * cost->radix_ns[w] / threads +
+                           (double)(threads << radix_widths[w]) * cost->prefix_ns +
+                           3 * cost->dispatch_ns;
+        double radix_cost = passes * pass_cost + 2 * cost->dispatch_ns;
+        if ((forced_engine == 0 || forced_engine == 'r') && radix_cost < best) {
+            best = radix_cost;
+            plan.engine = 'r';
+            plan.digit_bits = radix_widths[w];
+        }
+    }
+    return plan;
+}
+
+// Sort items with whichever engine plan_sort expects to be fastest
+void sort_items(SortItem* items, int n) {
+    SortPlan plan = plan_sort(items, n);
+    switch (plan.engine) {
+        case 'n':
+            break;
+        case 'r':
+            parallel_count_sort(items, n, plan.digit_bits);
+            break;
+        case 'm':
+            parallel_merge_sort(items, n);
+            break;
+        case 'p':
+            parallel_sample_sort(items, n);
+            break;
+        default: {
+            SortItem* aux = (SortItem*)counted_malloc(n * sizeof(SortItem));
+            if (aux == NULL && n > 0) {
+                fprintf(stderr, "Memory allocation failed\n");
+                exit(1);
+            }
+            merge_sort_sequential(items, aux, 0, n, 0);
+            free(aux);
+            break;
+        }
+    }
+}
+
+// Full-length name sorting, MSD radix style with 8 byte digits. The items arrive
+// sorted by the key of their first 8 bytes; every run of equal keys whose names
+// go on past that digit is re-keyed with the next 8 bytes, sorted stably and
+// refined the same way, until every group is decided.
+typedef struct {
+    int lo;
+    int hi;
+} NameGroup;
+
+typedef struct {
+    const RecordStore* store;
+    SortItem* items;
+    SortItem* aux;
+    int depth;
+    const NameGroup* groups;
+    int ngroups;
+    atomic_int next_group;
+} NameRefineArgs;
+
+void rekey_names(const RecordStore* store, SortItem* items, int lo, int hi, int depth) {
+    for (int i = lo; i < hi; i++) {
+        unsigned int r = items[i].idx;
+        items[i].key = name_chunk_key(store->arena + store->name_offs[r], (int)store->name_lens[r], depth);
+    }
+}
+
+// Is some name of the group longer than the depth + 8 bytes its key covers
+int names_continue(const RecordStore* store, const SortItem* items, int lo, int hi, int depth) {
+    for (int i = lo; i < hi; i++) {
+        if ((int)store->name_lens[items[i].idx] > depth + 8) return 1;
+    }
+    return 0;
+}
+
+// Stable insertion sort of items[lo, hi) by their names from byte depth on
+void insertion_sort_names(const RecordStore* store, SortItem* items, int lo, int hi, int depth) {
+    for (int i = lo + 1; i < hi; i++) {
+        SortItem item = items[i];
+        const char* name = store->arena + store->name_offs[item.idx];
+        int len = (int)store->name_lens[item.idx];
+        int j = i - 1;
+        while (j >= lo && compare_names(store->arena + store->name_offs[items[j].idx],
+                                        (int)store->name_lens[items[j].idx], name, len, depth) > 0) {
+            items[j + 1] = items[j];
+            j--;
+        }
+        items[j + 1] = item;
+    }
+}
+
+void refine_names(const RecordStore* store, SortItem* items, SortItem* aux, int lo, int hi, int depth);
+
+// Decide the order of one group of equal keys at depth, sequentially. The group
+// keeps its depth key afterwards, so items still carry the first digit's key.
+void refine_name_group(const RecordStore* store, SortItem* items, SortItem* aux, int lo, int hi, int depth) {
+    if (hi - lo <= INSERTION_SORT_CUTOFF) {
+        insertion_sort_names(store, items, lo, hi, depth + 8);
+        return;
+    }
+    unsigned long long key = items[lo].key;
+    rekey_names(store, items, lo, hi, depth + 8);
+    merge_sort_sequential(items, aux, lo, hi, 0);
+    refine_names(store, items, aux, lo, hi, depth + 8);
+    for (int i = lo; i < hi; i++) {
+        items[i].key = key;
+    }
+}
+
+// Refine every undecided group of items[lo, hi), which are sorted by their depth key
+void refine_names(const RecordStore* store, SortItem* items, SortItem* aux, int lo, int hi, int depth) {
+    int g = lo;
+    while (g < hi) {
+        int e = g + 1;
+        while (e < hi && items[e].key == items[g].key) e++;
+        if (e - g > 1 && names_continue(store, items, g, e, depth)) {
+            refine_name_group(store, items, aux, g, e, depth);
+        }
+        g = e;
+    }
+}
+
+// Pool task: workers claim the collected groups one at a time
+void refine_names_thread(void* arg, int tid, int nthreads) {
+    NameRefineArgs* args = (NameRefineArgs*)arg;
+    (void)tid;
+    (void)nthreads;
+    int g;
+    while ((g = atomic_fetch_add(&args->next_group, 1)) < args->ngroups) {
+        refine_name_group(args->store, args->items, args->aux,
+                          args->groups[g].lo, args->groups[g].hi, args->depth);
+    }
+}
+
+// Parallel refinement of items[lo, hi). Groups larger than big are sorted with the
+// parallel engines one after another, the rest are spread over the pool.
+void refine_names_parallel(const RecordStore* store, SortItem* items, SortItem* aux,
+                           int lo, int hi, int depth, int big) {
+    NameGroup* groups = NULL;
+    int ngroups = 0;
+    int capacity = 0;
+    int g = lo;
+    while (g < hi) {
+        int e = g + 1;
+        while (e < hi && items[e].key == items[g].key) e++;
+        if (e - g > big && names_continue(store, items, g, e, depth)) {
+            unsigned long long key = items[g].key;
+            rekey_names(store, items, g, e, depth + 8);
+            sort_items(items + g, e - g);
+            refine_names_parallel(store, items, aux, g, e, depth + 8, big);
+            for (int i = g; i < e; i++) {
+                items[i].key = key;
+            }
+        } else if (e - g > 1 && names_continue(store, items, g, e, depth)) {
+            if (ngroups == capacity) {
+                capacity = (capacity > 0) ? capacity * 2 : 64;
+                groups = (NameGroup*)counted_realloc(groups, capacity * sizeof(NameGroup));
+                if (groups == NULL) {
+                    fprintf(stderr, "Memory allocation failed\n");
+                    exit(1);
+                }
+            }
+            groups[ngroups].lo = g;
+            groups[ngroups].hi = e;
+            ngroups++;
+        }
+        g = e;
+    }
+    
+    if (ngroups > 0) {
+        NameRefineArgs args;
+        args.store = store;
+        args.items = items;
+        args.aux = aux;
+        args.depth = depth;
+        args.groups = groups;
+        args.ngroups = ngroups;
+        atomic_init(&args.next_group, 0);
+        pool_run(get_sort_pool(), refine_names_thread, &args);
+    }
+    free(groups);
+}
+
+// Sort items built by build_sort_items for the name column. When every name fits
+// in the packed key this is just sort_items; otherwise the ties it leaves between
+// longer names are refined on the following bytes.
+void sort_name_items(const RecordStore* store, SortItem* items, int n) {
+    sort_items(items, n);
+    if (store->max_name_len <= 8) return;
+    
+    SortItem* aux = (SortItem*)counted_malloc(n * sizeof(SortItem));
+    if (aux == NULL && n > 0) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    int nthreads = get_sort_pool()->nthreads;
+    int big = n / nthreads;
+    if (big < FORK_JOIN_GRAIN) big = FORK_JOIN_GRAIN;
+    refine_names_parallel(store, items, aux, 0, n, 0, big);
+    free(aux);
+}
+
+// Composite keys. Every column is range reduced (key - min), and consecutive
+// columns whose reduced widths add up to at most 64 bits are packed into one
+// key, the last column in the low bits. Each such segment costs one stable sort,
+// run from the last segment to the first, so the common case of a spec that
+// fits one word is a single sort. Names longer than the packed key get a
+// segment of their own, sorted by sort_name_items.
+typedef struct {
+    SortSpec spec;
+    unsigned long long mins[MAX_SORT_COLUMNS];
+    int shifts[MAX_SORT_COLUMNS];         // where column c sits in its segment's key
+    int seg_start[MAX_SORT_COLUMNS + 1];  // segment s covers columns [seg_start[s], seg_start[s + 1])
+    int nsegs;
+    int long_names;                       // some name needs more than the packed key
+} CompositeKeys;
+
+typedef struct {
+    const RecordStore* store;
+    const SortSpec* spec;
+    const SortItem* items;       // records to measure, NULL for records 0 .. n - 1
+    int n;
+    unsigned long long* mins;    // nthreads x ncols
+    unsigned long long* maxs;
+} ColumnStatsArgs;
+
+// Pool task: key range of every spec column over the worker's chunk
+void column_stats_thread(void* arg, int tid, int nthreads) {
+    ColumnStatsArgs* args = (ColumnStatsArgs*)arg;
+    const RecordStore* store = args->store;
+    int lo = chunk_start(tid, args->n, nthreads);
+    int hi = chunk_start(tid + 1, args->n, nthreads);
+    for (int c = 0; c < args->spec->ncols; c++) {
+        char column = args->spec->cols[c];
+        unsigned long long min_key = ULLONG_MAX, max_key = 0;
+        for (int i = lo; i < hi; i++) {
+            int r = (args->items != NULL) ? (int)args->items[i].idx : i;
+            unsigned long long key = column_key(store, r, column);
+            if (key < min_key) min_key = key;
+            if (key > max_key) max_key = key;
+        }
+        args->mins[tid * args->spec->ncols + c] = min_key;
+        args->maxs[tid * args->spec->ncols + c] = max_key;
+    }
+}
+
+// Lay out the segments for sorting n records: items[0, n), or records 0 .. n - 1
+// when items is NULL
+void plan_composite_keys(const RecordStore* store, const SortSpec* spec, const SortItem* items, int n,
+                         CompositeKeys* ck) {
+    WorkerPool* pool = get_sort_pool();
+    int nthreads = pool->nthreads;
+    int ncols = spec->ncols;
+    unsigned long long mins[nthreads * ncols], maxs[nthreads * ncols];
+    ColumnStatsArgs args = { store, spec, items, n, mins, maxs };
+    pool_run(pool, column_stats_thread, &args);
+    
+    ck->spec = *spec;
+    ck->long_names = 0;
+    int bits[MAX_SORT_COLUMNS];
+    for (int c = 0; c < ncols; c++) {
+        unsigned long long min_key = ULLONG_MAX, max_key = 0;
+        for (int t = 0; t < nthreads; t++) {
+            if (mins[t * ncols + c] < min_key) min_key = mins[t * ncols + c];
+            if (maxs[t * ncols + c] > max_key) max_key = maxs[t * ncols + c];
+        }
+        if (n == 0) min_key = max_key = 0;
+        ck->mins[c] = min_key;
+        bits[c] = 0;
+        for (unsigned long long range = max_key - min_key; range > 0; range >>= 1) {
+            bits[c]++;
+        }
+    }
+    unsigned int max_len = store->max_name_len;
+    
+    // Cut segments from the last column backwards
+    int ends[MAX_SORT_COLUMNS];
+    int nsegs = 0;
+    int seg_bits = 0;
+    int end = ncols;
+    for (int c = ncols - 1; c >= 0; c--) {
+        int long_name = (spec->cols[c] == 'N' && max_len > 8);
+        if (c < end - 1 && (long_name || seg_bits + bits[c] > 64)) {
+            ends[nsegs++] = end;
+            end = c + 1;
+            seg_bits = 0;
+        }
+        ck->shifts[c] = (bits[c] > 0) ? seg_bits : 0;
+        seg_bits += bits[c];
+        if (long_name) {
+            ck->long_names = 1;
+            if (c > 0) {
+                ends[nsegs++] = end;
+                end = c;
+                seg_bits = 0;
+            }
+        }
+    }
+    ends[nsegs++] = end;
+    
+    // ends[] runs from the last segment to the first
+    ck->nsegs = nsegs;
+    ck->seg_start[0] = 0;
+    for (int s = 1; s <= nsegs; s++) {
+        ck->seg_start[s] = ends[nsegs - s];
+    }
+}
+
+typedef struct {
+    const RecordStore* store;
+    const CompositeKeys* ck;
+    SortItem* items;
+    int n;
+    int seg;
+    int first_pass;              // items are fresh: idx is the position
+} CompositeKeysArgs;
+
+// Pool task: key every item of the worker's chunk with its record's segment key
+void composite_keys_thread(void* arg, int tid, int nthreads) {
+    CompositeKeysArgs* args = (CompositeKeysArgs*)arg;
+    const CompositeKeys* ck = args->ck;
+    int lo = chunk_start(tid, args->n, nthreads);
+    int hi = chunk_start(tid + 1, args->n, nthreads);
+    int c0 = ck->seg_start[args->seg];
+    int c1 = ck->seg_start[args->seg + 1];
+    for (int i = lo; i < hi; i++) {
+        int r = args->first_pass ? i : (int)args->items[i].idx;
+        unsigned long long key = 0;
+        for (int c = c0; c < c1; c++) {
+            key |= (column_key(args->store, r, ck->spec.cols[c]) - ck->mins[c]) << ck->shifts[c];
+        }
+        args->items[i].key = key;
+        args->items[i].idx = (unsigned int)r;
+    }
+}
+
+void sort_column_items(const RecordStore* store, SortItem* items, int n, char column) {
+    if (column == 'N') {
+        sort_name_items(store, items, n);
+    } else {
+        sort_items(items, n);
+    }
+}
+
+// One stable sort per key segment, last segment first. Fresh items are keyed
+// by position, otherwise through their idx.
+void sort_composite(const RecordStore* store, SortItem* items, int n, const SortSpec* spec, int fresh) {
+    CompositeKeys ck;
+    plan_composite_keys(store, spec, fresh ? NULL : items, n, &ck);
+    for (int s = ck.nsegs - 1; s >= 0; s--) {
+        CompositeKeysArgs args = { store, &ck, items, n, s, fresh && s == ck.nsegs - 1 };
+        pool_run(get_sort_pool(), composite_keys_thread, &args);
+        if (ck.seg_start[s + 1] - ck.seg_start[s] == 1 && spec->cols[ck.seg_start[s]] == 'N' && ck.long_names) {
+            sort_name_items(store, items, n);
+        } else {
+            sort_items(items, n);
+        }
+    }
+}
+
+// Give every item the plain key of column, for its record, keeping the order
+void rekey_items(const RecordStore* store, SortItem* items, int n, char column) {
+    CompositeKeys ck;
+    memset(&ck, 0, sizeof(ck));
+    ck.spec.ncols = 1;
+    ck.spec.cols[0] = column;
+    ck.nsegs = 1;
+    ck.seg_start[1] = 1;
+    CompositeKeysArgs args = { store, &ck, items, n, 0, 0 };
+    pool_run(get_sort_pool(), composite_keys_thread, &args);
+}
+
+// Sort all of the store's records by spec into items. Single columns take the
+// plain key path; composite specs run one stable sort per key segment.
+void sort_records(const RecordStore* store, SortItem* items, int n, const SortSpec* spec) {
+    if (spec->ncols == 1) {
+        build_sort_items(store, items, spec->cols[0]);
+        sort_column_items(store, items, n, spec->cols[0]);
+    } else {
+        sort_composite(store, items, n, spec, 1);
+    }
+}
+
+// Sort items[0, n), any subset of the records with their idx set, by spec
+void sort_selected(const RecordStore* store, SortItem* items, int n, const SortSpec* spec) {
+    if (spec->ncols == 1) {
+        rekey_items(store, items, n, spec->cols[0]);
+        sort_column_items(store, items, n, spec->cols[0]);
+    } else {
+        sort_composite(store, items, n, spec, 0);
+    }
+}
+
+// Text layout of one record: short names are space padded to MAX_FILENAME,
+// exactly like printf("%-9s \t%d\t\t%s\n") would produce.
+// Returns the number of bytes written to buf.
+size_t format_record_text(const RecordStore* store, int i, char* buf) {
+    char* p = buf;
+    int len = (int)store->name_lens[i];
+    int width = (len == MAX_FILENAME - 1) ? len : MAX_FILENAME;
+    memcpy(p, store->arena + store->name_offs[i], len);
+    p += len;
+    for (int k = len; k < width; k++) *p++ = ' ';
+    *p++ = ' ';
+    *p++ = '\t';
+    
+    // Integer formatting without printf: digits are produced backwards into a scratch buffer
+    char digits[12];
+    int nd = 0;
+    long long id = store->ids[i];
+    if (id < 0) {
+        *p++ = '-';
+        id = -id;
+    }
+    do {
+        digits[nd++] = (char)('0' + id % 10);
+        id /= 10;
+    } while (id > 0);
+    while (nd > 0) *p++ = digits[--nd];
+    
+    *p++ = '\t';
+    *p++ = '\t';
+    memcpy(p, store->arena + store->timestamp_offs[i], TIMESTAMP_LEN);
+    p += TIMESTAMP_LEN;
+    *p++ = '\n';
+    return (size_t)(p - buf);
+}
+
+// Binary layout of one record, host byte order:
+// u32 name_len, name bytes, i32 id, i64 Unix timestamp (UTC)
+size_t format_record_binary(const RecordStore* store, int i, char* buf) {
+    char* p = buf;
+    unsigned int len = store->name_lens[i];
+    memcpy(p, &len, sizeof(len));
+    p += sizeof(len);
+    memcpy(p, store->arena + store->name_offs[i], len);
+    p += len;
+    memcpy(p, &store->ids[i], sizeof(int));
+    p += sizeof(int);
+    memcpy(p, &store->timestamp_vals[i], sizeof(long long));
+    p += sizeof(long long);
+    return (size_t)(p - buf);
+}
+
+// Upper bound on the formatted size of record i in either layout
+size_t record_size_bound(const RecordStore* store, int i) {
+    return store->name_lens[i] + MAX_FILENAME + TIMESTAMP_LEN + 32;
+}
+
+// Write every byte of iov[0 .. count), retrying on short writes. Returns 0 on success.
+int write_all_iov(int fd, struct iovec* iov, int count) {
+    while (count > 0) {
+        int batch = (count < IOV_MAX) ? count : IOV_MAX;
+        ssize_t written = writev(fd, iov, batch);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+typedef struct {
+    const RecordStore* store;
+    const SortItem* items;
+    int n;
+    char format;                 // 't' text, 'b' binary
+    int keyed;                   // prefix every record with its u64 key and u32 length (run files)
+    int fd;
+    const char* header;          // written before the first record, may be NULL
+    char** bufs;                 // one growable buffer per worker
+    size_t* capacities;
+    struct iovec* iov;           // bufs[t] and its fill for the current round
+    int failed;
+} OutputArgs;
+
+// Pool task for output. The sorted items are formatted in rounds of
+// nthreads * OUTPUT_BATCH records; within a round every worker formats its own
+// contiguous slice into its own buffer, then the serial thread hands all the
+// buffers to writev in worker order.
+void output_thread(void* arg, int tid, int nthreads) {
+    OutputArgs* args = (OutputArgs*)arg;
+    WorkerPool* pool = &sort_pool;
+    int round = nthreads * OUTPUT_BATCH;
+    
+    if (tid == 0 && args->header != NULL) {
+        struct iovec header = { (void*)args->header, strlen(args->header) };
+        if (write_all_iov(args->fd, &header, 1) != 0) args->failed = 1;
+    }
+    
+    for (int base = 0; base < args->n; base += round) {
+        int count = (args->n - base < round) ? args->n - base : round;
+        int lo = base + chunk_start(tid, count, nthreads);
+        int hi = base + chunk_start(tid + 1, count, nthreads);
+        
+        size_t bound = 0;
+        for (int i = lo; i < hi; i++) {
+            bound += record_size_bound(args->store, args->items[i].idx) + RUN_HEADER_SIZE;
+        }
+        if (bound > args->capacities[tid]) {
+            free(args->bufs[tid]);
+            args->bufs[tid] = (char*)counted_malloc(bound);
+            if (args->bufs[tid] == NULL) {
+                fprintf(stderr, "Memory allocation failed\n");
+                exit(1);
+            }
+            args->capacities[tid] = bound;
+        }
+        
+        char* p = args->bufs[tid];
+        for (int i = lo; i < hi; i++) {
+            char* record = args->keyed ? p + RUN_HEADER_SIZE : p;
+            size_t len;
+            if (args->format == 'b') {
+                len = format_record_binary(args->store, args->items[i].idx, record);
+            } else {
+                len = format_record_text(args->store, args->items[i].idx, record);
+            }
+            if (args->keyed) {
+                unsigned int len32 = (unsigned int)len;
+                memcpy(p, &args->items[i].key, sizeof(unsigned long long));
+                memcpy(p + sizeof(unsigned long long), &len32, sizeof(unsigned int));
+                len += RUN_HEADER_SIZE;
+            }
+            p += len;
+        }
+        args->iov[tid].iov_base = args->bufs[tid];
+        args->iov[tid].iov_len = (size_t)(p - args->bufs[tid]);
+        
+        if (pool_barrier(pool) && !args->failed) {
+            if (write_all_iov(args->fd, args->iov, nthreads) != 0) args->failed = 1;
+        }
+        // Buffers are reused next round, so wait for the write
+        pool_barrier(pool);
+    }
+}
+
+// Write the sorted records to fd in the given format ('t' text, 'b' binary).
+// With keyed set every record is preceded by its sort key and length, which is
+// the layout of the external sort's run files. Returns 0 on success.
+int write_sorted(const RecordStore* store, const SortItem* items, int n, char format, int keyed,
+                 int fd, const char* header) {
+    WorkerPool* pool = get_sort_pool();
+    OutputArgs args;
+    args.store = store;
+    args.items = items;
+    args.n = n;
+    args.format = format;
+    args.fd = fd;
+    args.keyed = keyed;
+    args.header = header;
+    args.bufs = (char**)counted_calloc(pool->nthreads, sizeof(char*));
+    args.capacities = (size_t*)counted_calloc(pool->nthreads, sizeof(size_t));
+    args.iov = (struct iovec*)counted_calloc(pool->nthreads, sizeof(struct iovec));
+    args.failed = 0;
+    if (args.bufs == NULL || args.capacities == NULL || args.iov == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    
+    pool_run(pool, output_thread, &args);
+    
+    for (int t = 0; t < pool->nthreads; t++) {
+        free(args.bufs[t]);
+    }
+    free(args.bufs);
+    free(args.capacities);
+    free(args.iov);
+    return args.failed ? -1 : 0;
+}
+
+// Columnar file format (-f columnar): a header, the fixed width columns of the
+// record store exactly as they sit in memory, and a string heap holding every
+// record's name and timestamp text. Loading maps the file and points the store
+// at it, so nothing is parsed and sorting starts immediately; sorted output can
+// be saved in the same format for the next job. All values are in host byte
+// order, which the header records.
+typedef struct {
+    char magic[8];               // COLUMNAR_MAGIC
+    unsigned int byte_order;     // COLUMNAR_BYTE_ORDER as written by the producer
+    unsigned int max_name_len;
+    unsigned long long n;
+    unsigned long long heap_bytes;
+    char spec[SORT_SPEC_LEN];    // sort spec the records are ordered by (or came with)
+} ColumnarHeader;
+
+// Byte offsets of the columns; each starts 8 byte aligned
+typedef struct {
+    size_t ids;
+    size_t timestamp_vals;
+    size_t name_keys;
+    size_t name_offs;
+    size_t timestamp_offs;
+    size_t name_lens;
+    size_t heap;
+} ColumnarLayout;
+
+void columnar_layout(unsigned long long n, ColumnarLayout* layout) {
+    size_t off = sizeof(ColumnarHeader);
+    layout->ids = off;
+    off = (off + n * sizeof(int) + 7) & ~(size_t)7;
+    layout->timestamp_vals = off;
+    off += n * sizeof(long long);
+    layout->name_keys = off;
+    off += n * sizeof(unsigned long long);
+    layout->name_offs = off;
+    off += n * sizeof(size_t);
+    layout->timestamp_offs = off;
+    off += n * sizeof(size_t);
+    layout->name_lens = off;
+    off = (off + n * sizeof(unsigned int) + 7) & ~(size_t)7;
+    layout->heap = off;
+}
+
+int is_columnar(const InputBuffer* input) {
+    return input->len >= sizeof(ColumnarHeader) && memcmp(input->data, COLUMNAR_MAGIC, 8) == 0;
+}
+
+// Point store at the columns of the columnar file in input. Returns 0, or -1
+// (after reporting) if the file is not usable on this machine.
+int load_columnar(const InputBuffer* input, RecordStore* store, char* sort_column, int size) {
+    ColumnarHeader header;
+    memcpy(&header, input->data, sizeof(header));
+    ColumnarLayout layout;
+    columnar_layout(header.n, &layout);
+    if (header.byte_order != COLUMNAR_BYTE_ORDER || sizeof(size_t) != sizeof(unsigned long long)) {
+        fprintf(stderr, "Columnar input was written with a different byte order or word size\n");
+        return -1;
+    }
+    if (header.n > INT_MAX || input->len < layout.heap || input->len - layout.heap < header.heap_bytes) {
+        fprintf(stderr, "Truncated columnar input\n");
+        return -1;
+    }
+    char* data = input->data;
+    store->n = (int)header.n;
+    store->ids = (int*)(data + layout.ids);
+    store->timestamp_vals = (long long*)(data + layout.timestamp_vals);
+    store->name_keys = (unsigned long long*)(data + layout.name_keys);
+    store->name_offs = (size_t*)(data + layout.name_offs);
+    store->timestamp_offs = (size_t*)(data + layout.timestamp_offs);
+    store->name_lens = (unsigned int*)(data + layout.name_lens);
+    store->max_name_len = header.max_name_len;
+    store->arena = data + layout.heap;
+    store->mapped = 1;
+    
+    // The columns are used as heap offsets unchecked from here on (and
+    // max_name_len sizes output buffers), so a damaged file is rejected now
+    for (int i = 0; i < store->n; i++) {
+        if (store->name_lens[i] > store->max_name_len || store->name_offs[i] > header.heap_bytes ||
+            header.heap_bytes - store->name_offs[i] < store->name_lens[i] ||
+            store->timestamp_offs[i] > header.heap_bytes ||
+            header.heap_bytes - store->timestamp_offs[i] < TIMESTAMP_LEN) {
+            fprintf(stderr, "Corrupt columnar input at record %d\n", i);
+            return -1;
+        }
+    }
+    header.spec[SORT_SPEC_LEN - 1] = '\0';
+    snprintf(sort_column, size, "%s", header.spec);
+    return 0;
+}
+
+typedef struct {
+    const RecordStore* store;
+    const SortItem* items;
+    int n;
+    const char* spec;
+    ColumnarLayout layout;
+    size_t* heap_offs;           // heap bytes of each worker's chunk, then where it starts
+    char* image;                 // the whole file, allocated once the heap size is known
+    size_t image_size;
+} ColumnarArgs;
+
+// Pool task: copy the worker's chunk of records, in item order, into every
+// column of the image and its names and timestamps into the heap
+void columnar_thread(void* arg, int tid, int nthreads) {
+    ColumnarArgs* args = (ColumnarArgs*)arg;
+    WorkerPool* pool = &sort_pool;
+    const RecordStore* store = args->store;
+    int lo = chunk_start(tid, args->n, nthreads);
+    int hi = chunk_start(tid + 1, args->n, nthreads);
+    
+    size_t heap_bytes = 0;
+    for (int i = lo; i < hi; i++) {
+        heap_bytes += store->name_lens[args->items[i].idx] + TIMESTAMP_LEN;
+    }
+    args->heap_offs[tid] = heap_bytes;
+    if (pool_barrier(pool)) {
+        size_t sum = 0;
+        for (int t = 0; t < nthreads; t++) {
+            size_t bytes = args->heap_offs[t];
+            args->heap_offs[t] = sum;
+            sum += bytes;
+        }
+        args->image_size = args->layout.heap + sum;
+        args->image = (char*)counted_calloc(args->image_size, 1);
+        if (args->image == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        ColumnarHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, COLUMNAR_MAGIC, 8);
+        header.byte_order = COLUMNAR_BYTE_ORDER;
+        header.max_name_len = store->max_name_len;
+        header.n = (unsigned long long)args->n;
+        header.heap_bytes = sum;
+        snprintf(header.spec, SORT_SPEC_LEN, "%s", args->spec);
+        memcpy(args->image, &header, sizeof(header));
+    }
+    pool_barrier(pool);
+    
+    char* image = args->image;
+    int* ids = (int*)(image + args->layout.ids);
+    long long* timestamp_vals = (long long*)(image + args->layout.timestamp_vals);
+    unsigned long long* name_keys = (unsigned long long*)(image + args->layout.name_keys);
+    size_t* name_offs = (size_t*)(image + args->layout.name_offs);
+    size_t* timestamp_offs = (size_t*)(image + args->layout.timestamp_offs);
+    unsigned int* name_lens = (unsigned int*)(image + args->layout.name_lens);
+    char* heap = image + args->layout.heap;
+    size_t off = args->heap_offs[tid];
+    for (int i = lo; i < hi; i++) {
+        int r = (int)args->items[i].idx;
+        ids[i] = store->ids[r];
+        timestamp_vals[i] = store->timestamp_vals[r];
+        name_keys[i] = store->name_keys[r];
+        name_lens[i] = store->name_lens[r];
+        name_offs[i] = off;
+        memcpy(heap + off, store->arena + store->name_offs[r], store->name_lens[r]);
+        off += store->name_lens[r];
+        timestamp_offs[i] = off;
+        memcpy(heap + off, store->arena + store->timestamp_offs[r], TIMESTAMP_LEN);
+        off += TIMESTAMP_LEN;
+    }
+}
+
+// Write items[0, n) in order as a columnar file ordered by spec. Returns 0, or -1 if writing failed.
+int write_columnar(const RecordStore* store, const SortItem* items, int n, const char* spec, int fd) {
+    ColumnarArgs args;
+    args.store = store;
+    args.items = items;
+    args.n = n;
+    args.spec = spec;
+    columnar_layout((unsigned long long)n, &args.layout);
+    args.heap_offs = (size_t*)counted_malloc(get_sort_pool()->nthreads * sizeof(size_t));
+    args.image = NULL;
+    if (args.heap_offs == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    pool_run(get_sort_pool(), columnar_thread, &args);
+    struct iovec iov = { args.image, args.image_size };
+    int status = write_all_iov(fd, &iov, 1);
+    free(args.image);
+    free(args.heap_offs);
+    return status;
+}
+
+// Write the sorted items to stdout in the requested output format
+int write_output(const RecordStore* store, const SortItem* items, int n, char format,
+                 const char* spec, const char* header) {
+    if (format == 'c') {
+        return write_columnar(store, items, n, spec, STDOUT_FILENO);
+    }
+    return write_sorted(store, items, n, format, 0, STDOUT_FILENO, (format == 't') ? header : NULL);
+}
+
+// Parse text input: the record count line, the records and the sort column
+// line. Returns 0, or -1 (after reporting and freeing store) on bad input.
+int parse_text_input(const InputBuffer* input, RecordStore* store, char* sort_column, int size) {
+    // The record count is on the first line; records start on the next one
+    const char* data = input->data;
+    const char* end = input->data + input->len;
+    const char* p = data;
+    int n;
+    while (p < end && is_blank(*p)) p++;
+    p = parse_int(p, end, &n);
+    if (p == NULL || n < 0) {
+        fprintf(stderr, "Invalid input for number of records\n");
+        return -1;
+    }
+    while (p < end && *p != '\n') p++;
+    if (p < end) p++;
+    
+    store_init(store, n);
+    store->arena = input->data;
+    
+    // Parse all records in parallel
+    size_t column_pos;
+    int bad_record = parse_records(data, (size_t)(p - data), input->len, store, &column_pos);
+    if (bad_record < 0 && store->n < n) {
+        bad_record = store->n;
+    }
+    if (bad_record >= 0) {
+        fprintf(stderr, "Invalid input for record %d\n", bad_record);
+        store_free(store);
+        return -1;
+    }
+    
+    if (column_pos >= input->len) {
+        fprintf(stderr, "Invalid input for sort column\n");
+        store_free(store);
+        return -1;
+    }
+    read_sort_column(data, column_pos, input->len, sort_column, size);
+    return 0;
+}
+
+// Selection: top-K and key ranges without sorting everything. Items are split
+// by stable three-way partitions on the first column's key into a stack of
+// strict boundaries (every item before a boundary has a smaller key than every
+// item after it), which is refined only where output is asked for. Segments
+// that are wholly wanted are sorted by the full spec; everything past the
+// requested position stays unsorted until a later request reaches it, so
+// each further page of K records costs about O(K log K).
+typedef struct {
+    SortItem* items;
+    SortItem* aux;               // partition scratch, allocated on first use
+    int n;
+    int lo;                      // segment being partitioned
+    int hi;
+    unsigned long long lo_key;   // class 0 is key < lo_key, class 2 key > hi_key, class 1 the rest
+    unsigned long long hi_key;
+    const RecordStore* store;    // set for exact name bounds
+    const char* lo_name;
+    int lo_name_len;
+    const char* hi_name;
+    int hi_name_len;
+    int* counts;                 // nthreads x 3 class counts, turned into write offsets
+    int* histograms;             // nthreads x 2^SELECT_DIGIT_BITS, for radix select
+    unsigned long long* min_vals;
+    unsigned long long* max_vals;
+    int target;                  // radix select: items wanted from the segment start
+    int split[2];                // resulting class boundaries
+} PartitionArgs;
+
+int partition_class(const PartitionArgs* args, const SortItem* item) {
+    if (item->key < args->lo_key) return 0;
+    if (item->key > args->hi_key) return 2;
+    if (args->store != NULL) {
+        const char* name = args->store->arena + args->store->name_offs[item->idx];
+        int len = (int)args->store->name_lens[item->idx];
+        if (args->lo_name != NULL && item->key == args->lo_key &&
+            compare_names(name, len, args->lo_name, args->lo_name_len, 0) < 0) return 0;
+        if (args->hi_name != NULL && item->key == args->hi_key &&
+            compare_names(name, len, args->hi_name, args->hi_name_len, 0) > 0) return 2;
+    }
+    return 1;
+}
+
+// Pool task: stable three-way partition of items[lo, hi) by partition_class.
+// Classes are laid out class-major, thread-minor, so each keeps the input order.
+void partition_thread(void* arg, int tid, int nthreads) {
+    PartitionArgs* args = (PartitionArgs*)arg;
+    WorkerPool* pool = &sort_pool;
+    int size = args->hi - args->lo;
+    int start = args->lo + chunk_start(tid, size, nthreads);
+    int end = args->lo + chunk_start(tid + 1, size, nthreads);
+    int* count = args->counts + tid * 3;
+    
+    count[0] = count[1] = count[2] = 0;
+    for (int i = start; i < end; i++) {
+        count[partition_class(args, &args->items[i])]++;
+    }
+    // Run directly (nthreads == 1) there is no pool to synchronise with
+    if (nthreads == 1 || pool_barrier(pool)) {
+        int sum = args->lo;
+        for (int c = 0; c < 3; c++) {
+            if (c > 0) args->split[c - 1] = sum;
+            for (int t = 0; t < nthreads; t++) {
+                int k = args->counts[t * 3 + c];
+                args->counts[t * 3 + c] = sum;
+                sum += k;
+            }
+        }
+    }
+    if (nthreads > 1) pool_barrier(pool);
+    for (int i = start; i < end; i++) {
+        args->aux[count[partition_class(args, &args->items[i])]++] = args->items[i];
+    }
+    if (nthreads > 1) pool_barrier(pool);
+    memcpy(args->items + start, args->aux + start, (end - start) * sizeof(SortItem));
+}
+
+// Partition items[lo, hi) in place; returns the class boundaries in args->split
+void partition_items(PartitionArgs* args, int lo, int hi) {
+    args->lo = lo;
+    args->hi = hi;
+    if (hi - lo >= SELECT_PARALLEL_MIN) {
+        pool_run(get_sort_pool(), partition_thread, args);
+    } else {
+        partition_thread(args, 0, 1);
+    }
+}
+
+// Pool task for radix select: key range and then a histogram of the top
+// SELECT_DIGIT_BITS of (key - min) over the segment
+void radix_select_thread(void* arg, int tid, int nthreads) {
+    PartitionArgs* args = (PartitionArgs*)arg;
+    WorkerPool* pool = &sort_pool;
+    int size = args->hi - args->lo;
+    int start = args->lo + chunk_start(tid, size, nthreads);
+    int end = args->lo + chunk_start(tid + 1, size, nthreads);
+    
+    unsigned long long min_val = ULLONG_MAX, max_val = 0;
+    for (int i = start; i < end; i++) {
+        unsigned long long value = args->items[i].key;
+        if (value < min_val) min_val = value;
+        if (value > max_val) max_val = value;
+    }
+    args->min_vals[tid] = min_val;
+    args->max_vals[tid] = max_val;
+    pool_barrier(pool);
+    for (int t = 0; t < nthreads; t++) {
+        if (args->min_vals[t] < min_val) min_val = args->min_vals[t];
+        if (args->max_vals[t] > max_val) max_val = args->max_vals[t];
+    }
+    int range_bits = 0;
+    for (unsigned long long range = max_val - min_val; range > 0; range >>= 1) {
+        range_bits++;
+    }
+    int shift = (range_bits > SELECT_DIGIT_BITS) ? range_bits - SELECT_DIGIT_BITS : 0;
+    int* count = args->histograms + tid * (1 << SELECT_DIGIT_BITS);
+    memset(count, 0, (1 << SELECT_DIGIT_BITS) * sizeof(int));
+    for (int i = start; i < end; i++) {
+        count[(args->items[i].key - min_val) >> shift]++;
+    }
+    
+    // The digit holding the target-th item becomes class 1
+    if (pool_barrier(pool)) {
+        int before = 0;
+        int digit = 0;
+        for (; digit < (1 << SELECT_DIGIT_BITS) - 1; digit++) {
+            int c = 0;
+            for (int t = 0; t < nthreads; t++) {
+                c += args->histograms[t * (1 << SELECT_DIGIT_BITS) + digit];
+            }
+            if (before + c >= args->target) break;
+            before += c;
+        }
+        args->lo_key = min_val + ((unsigned long long)digit << shift);
+        args->hi_key = args->lo_key + ((1ULL << shift) - 1);
+    }
+}
+
+typedef struct {
+    const RecordStore* store;
+    const SortSpec* spec;
+    SortItem* items;
+    int n;
+    int key_decides;             // the first column key alone orders the records
+    int frontier;                // items[0, frontier) are in their final order
+    int* bounds;                 // boundary stack, the nearest one on top
+    int nbounds;
+    int bounds_capacity;
+    PartitionArgs part;
+} Selector;
+
+void selector_push(Selector* sel, int bound) {
+    if (sel->nbounds == sel->bounds_capacity) {
+        sel->bounds_capacity *= 2;
+        sel->bounds = (int*)counted_realloc(sel->bounds, sel->bounds_capacity * sizeof(int));
+        if (sel->bounds == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+    }
+    sel->bounds[sel->nbounds++] = bound;
+}
+
+// Select over items[0, n), which hold the plain first column key of their
+// record and are in input order
+void selector_init(Selector* sel, const RecordStore* store, const SortSpec* spec, SortItem* items, int n) {
+    WorkerPool* pool = get_sort_pool();
+    sel->store = store;
+    sel->spec = spec;
+    sel->items = items;
+    sel->n = n;
+    sel->key_decides = (spec->ncols == 1 && (spec->cols[0] != 'N' || store->max_name_len <= 8));
+    sel->frontier = 0;
+    sel->bounds_capacity = 64;
+    sel->bounds = (int*)counted_malloc(sel->bounds_capacity * sizeof(int));
+    sel->nbounds = 1;
+    memset(&sel->part, 0, sizeof(sel->part));
+    sel->part.items = items;
+    sel->part.aux = (SortItem*)counted_malloc(n * sizeof(SortItem));
+    sel->part.counts = (int*)counted_malloc(pool->nthreads * 3 * sizeof(int));
+    sel->part.histograms = (int*)counted_malloc(pool->nthreads * (1 << SELECT_DIGIT_BITS) * sizeof(int));
+    sel->part.min_vals = (unsigned long long*)counted_malloc(pool->nthreads * sizeof(unsigned long long));
+    sel->part.max_vals = (unsigned long long*)counted_malloc(pool->nthreads * sizeof(unsigned long long));
+    if (sel->bounds == NULL || (sel->part.aux == NULL && n > 0) || sel->part.counts == NULL ||
+        sel->part.histograms == NULL || sel->part.min_vals == NULL || sel->part.max_vals == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    sel->bounds[0] = n;
+}
+
+void selector_free(Selector* sel) {
+    free(sel->part.max_vals);
+    free(sel->part.min_vals);
+    free(sel->part.histograms);
+    free(sel->part.counts);
+    free(sel->part.aux);
+    free(sel->bounds);
+}
+
+// Make items[0, want) final (fewer if there are fewer items); returns the frontier
+int selector_advance(Selector* sel, int want) {
+    if (want > sel->n) want = sel->n;
+    while (sel->frontier < want) {
+        int lo = sel->frontier;
+        int hi = sel->bounds[sel->nbounds - 1];
+        
+        int whole = (hi <= want || hi - lo <= INSERTION_SORT_CUTOFF);
+        if (!whole) {
+            // Cut the segment around the wanted position: radix select for large
+            // segments, a median of three pivot otherwise
+            PartitionArgs* part = &sel->part;
+            part->store = NULL;
+            part->lo_name = part->hi_name = NULL;
+            if (hi - lo >= SELECT_PARALLEL_MIN) {
+                part->lo = lo;
+                part->hi = hi;
+                part->target = want - lo;
+                pool_run(get_sort_pool(), radix_select_thread, part);
+            } else {
+                unsigned long long a = sel->items[lo].key;
+                unsigned long long b = sel->items[lo + (hi - lo) / 2].key;
+                unsigned long long c = sel->items[hi - 1].key;
+                unsigned long long pivot = (a < b) ? ((b < c) ? b : ((a < c) ? c : a))
+                                                   : ((a < c) ? a : ((b < c) ? c : b));
+                part->lo_key = part->hi_key = pivot;
+            }
+            partition_items(part, lo, hi);
+            int split0 = part->split[0], split1 = part->split[1];
+            if (split0 == lo && split1 == hi) {
+                whole = 1;       // one run of equal keys
+            } else {
+                if (split1 < hi) selector_push(sel, split1);
+                if (split0 > lo && split0 < split1) selector_push(sel, split0);
+                continue;
+            }
+        }
+        
+        if (sel->key_decides) {
+            sort_items(sel->items + lo, hi - lo);
+        } else {
+            sort_selected(sel->store, sel->items + lo, hi - lo, sel->spec);
+        }
+        sel->frontier = hi;
+        sel->nbounds--;
+    }
+    return sel->frontier;
+}
+
+// Key of a --from / --to value in the first sort column. Returns 0 if valid.
+int parse_bound(const char* text, char column, unsigned long long* key) {
+    size_t len = strlen(text);
+    switch (column) {
+        case 'I': {
+            int id;
+            const char* end = parse_int(text, text + len, &id);
+            if (end != text + len) return -1;
+            *key = (unsigned long long)(long long)id ^ (1ULL << 63);
+            return 0;
+        }
+        case 'T': {
+            long long ts;
+            if (len != TIMESTAMP_LEN || convert_timestamp(text, &ts) != 0) return -1;
+            *key = (unsigned long long)ts ^ (1ULL << 63);
+            return 0;
+        }
+        default:
+            if (len == 0) return -1;
+            *key = name_chunk_key(text, (int)len, 0);
+            return 0;
+    }
+}
+
+// Selection output: the records whose first column lies in [from, to] (either
+// bound may be NULL), sorted, or only the first top of them when top > 0. With
+// pages set, further pages of top records follow for as long as there are any.
+// Returns 0, or -1 if writing failed.
+int write_selected(const RecordStore* store, SortItem* items, int n, const SortSpec* spec,
+                   const char* from, const char* to, int top, int pages, char format, const char* header) {
+    build_sort_items(store, items, spec->cols[0]);
+    Selector sel;
+    selector_init(&sel, store, spec, items, n);
+    
+    // Cut the key window out first; exact name bounds are compared in full
+    int lo = 0, hi = n;
+    if (from != NULL || to != NULL) {
+        PartitionArgs* part = &sel.part;
+        part->lo_key = 0;
+        part->hi_key = ULLONG_MAX;
+        part->store = (spec->cols[0] == 'N') ? store : NULL;
+        part->lo_name = part->hi_name = NULL;
+        if (from != NULL) {
+            parse_bound(from, spec->cols[0], &part->lo_key);
+            part->lo_name = from;
+            part->lo_name_len = (int)strlen(from);
+        }
+        if (to != NULL) {
+            parse_bound(to, spec->cols[0], &part->hi_key);
+            part->hi_name = to;
+            part->hi_name_len = (int)strlen(to);
+        }
+        if (part->lo_key > part->hi_key) {
+            hi = 0;
+        } else {
+            partition_items(part, 0, n);
+            lo = part->split[0];
+            hi = part->split[1];
+        }
+        sel.items = items + lo;
+        sel.part.items = items + lo;
+        sel.n = hi - lo;
+        sel.bounds[0] = hi - lo;
+    }
+    
+    int status = 0;
+    int page = (top > 0) ? top : hi - lo;
+    int pos = 0;
+    do {
+        int count = selector_advance(&sel, pos + page) - pos;
+        if (count > page) count = page;
+        status = write_sorted(store, items + lo + pos, count, format, 0, STDOUT_FILENO,
+                              (pos == 0) ? header : NULL);
+        pos += count;
+    } while (status == 0 && pages && pos < hi - lo);
+    selector_free(&sel);
+    return status;
+}
+
+// Parse a memory size such as 512M or 4G (suffixes K, M, G). Returns 0 if invalid.
+size_t parse_size(const char* text) {
+    char* end;
+    unsigned long long value = strtoull(text, &end, 10);
+    switch (toupper((unsigned char)*end)) {
+        case 'G': value <<= 10; /* fall through */
+        case 'M': value <<= 10; /* fall through */
+        case 'K': value <<= 10; end++; break;
+        case '\0': break;
+        default: return 0;
+    }
+    return (*end == '\0') ? (size_t)value : 0;
+}
+
+// Create an anonymous temporary file in dir; it disappears when closed
+int create_run_file(const char* dir) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/lazysort-run-XXXXXX", dir);
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror(path);
+        exit(1);
+    }
+    unlink(path);
+    return fd;
+}
+
+// Read up to len bytes, retrying on short reads. Returns the bytes read, or -1 on error.
+ssize_t read_full(int fd, char* buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t r = read(fd, buf + got, len - got);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (r == 0) break;
+        got += (size_t)r;
+    }
+    return (ssize_t)got;
+}
+
+// The sort column of a regular file is its last non-blank line; read it from the tail
+int read_trailing_column(int fd, char* column, int size) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) return -1;
+    char tail[256];
+    off_t from = (st.st_size > (off_t)sizeof(tail)) ? st.st_size - (off_t)sizeof(tail) : 0;
+    ssize_t len = pread(fd, tail, (size_t)(st.st_size - from), from);
+    if (len <= 0) return -1;
+    while (len > 0 && is_blank(tail[len - 1])) len--;
+    ssize_t start = len;
+    while (start > 0 && tail[start - 1] != '\n') start--;
+    while (start < len && is_blank(tail[start])) start++;
+    if (start == len) return -1;
+    read_sort_column(tail, (size_t)start, (size_t)len, column, size);
+    return 0;
+}
+
+// Fields of a record in the text or binary output layout
+typedef struct {
+    const char* name;
+    int name_len;
+    int id;
+    long long timestamp;
+} RecordFields;
+
+// Parse the record at p[0, avail) as written by format_record_text or
+// format_record_binary. Returns its length in bytes (up to and including the
+// newline in text), or -1 if it is malformed or truncated.
+long parse_formatted_record(const char* p, size_t avail, char format, RecordFields* f) {
+    if (format == 'b') {
+        unsigned int len;
+        if (avail < sizeof(len)) return -1;
+        memcpy(&len, p, sizeof(len));
+        if (avail - sizeof(len) < (size_t)len + sizeof(int) + sizeof(long long)) return -1;
+        f->name = p + sizeof(len);
+        f->name_len = (int)len;
+        memcpy(&f->id, f->name + len, sizeof(int));
+        memcpy(&f->timestamp, f->name + len + sizeof(int), sizeof(long long));
+        return (long)(sizeof(len) + len + sizeof(int) + sizeof(long long));
+    }
+    const char* line_end = memchr(p, '\n', avail);
+    const char* end = line_end ? line_end : p + avail;
+    const char* q = p;
+    f->name = q;
+    while (q < end && !is_blank(*q)) q++;
+    f->name_len = (int)(q - f->name);
+    while (q < end && is_blank(*q)) q++;
+    q = parse_int(q, end, &f->id);
+    if (f->name_len == 0 || q == NULL) return -1;
+    while (q < end && is_blank(*q)) q++;
+    if (end - q < TIMESTAMP_LEN || convert_timestamp(q, &f->timestamp) != 0) return -1;
+    return (long)(line_end ? end + 1 - p : end - p);
+}
+
+// Order of two records by the spec's columns
+int compare_fields(const SortSpec* spec, const RecordFields* a, const RecordFields* b) {
+    for (int c = 0; c < spec->ncols; c++) {
+        switch (spec->cols[c]) {
+            case 'I':
+                if (a->id != b->id) return (a->id < b->id) ? -1 : 1;
+                break;
+            case 'T':
+                if (a->timestamp != b->timestamp) return (a->timestamp < b->timestamp) ? -1 : 1;
+                break;
+            default: {
+                int order = compare_names(a->name, a->name_len, b->name, b->name_len, 0);
+                if (order != 0) return order;
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+// Sequential reader over one run file with its own large buffer
+typedef struct {
+    int fd;
+    char* buf;
+    size_t capacity;
+    size_t len;
+    size_t pos;
+    int done;
+    unsigned long long key;      // current record
+    const char* payload;
+    unsigned int payload_len;
+    const SortSpec* spec;        // columns that break key ties, NULL if keys decide
+    char format;                 // payload layout the tie columns are read from
+    RecordFields fields;         // current record, parsed when spec is set
+} RunReader;
+
+// Make at least need bytes available at buf[pos]. Returns 0 if they are.
+int run_fill(RunReader* run, size_t need) {
+    if (run->len - run->pos >= need) return 0;
+    memmove(run->buf, run->buf + run->pos, run->len - run->pos);
+    run->len -= run->pos;
+    run->pos = 0;
+    if (need > run->capacity) {
+        run->capacity = need;
+        run->buf = (char*)counted_realloc(run->buf, run->capacity);
+        if (run->buf == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+    }
+    ssize_t got = read_full(run->fd, run->buf + run->len, run->capacity - run->len);
+    if (got < 0) {
+        perror("read");
+        exit(1);
+    }
+    run->len += (size_t)got;
+    return (run->len >= need) ? 0 : -1;
+}
+
+// Advance to the next record of the run, or mark it done
+void run_next(RunReader* run) {
+    if (run_fill(run, RUN_HEADER_SIZE) != 0) {
+        run->done = 1;
+        return;
+    }
+    memcpy(&run->key, run->buf + run->pos, sizeof(unsigned long long));
+    memcpy(&run->payload_len, run->buf + run->pos + sizeof(unsigned long long), sizeof(unsigned int));
+    if (run_fill(run, RUN_HEADER_SIZE + run->payload_len) != 0) {
+        fprintf(stderr, "Truncated run file\n");
+        exit(1);
+    }
+    run->payload = run->buf + run->pos + RUN_HEADER_SIZE;
+    run->pos += RUN_HEADER_SIZE + run->payload_len;
+    
+    if (run->spec != NULL) {
+        parse_formatted_record(run->payload, run->payload_len, run->format, &run->fields);
+    }
+}
+
+// Run a comes out before run b: smaller key first, then the full sort spec when
+// the key alone cannot decide (long names, composite specs), then run order
+// (the runs were cut from the input in order, so this keeps the merge stable)
+int run_before(const RunReader* runs, int a, int b) {
+    if (runs[a].done) return 0;
+    if (runs[b].done) return 1;
+    if (runs[a].key != runs[b].key) return runs[a].key < runs[b].key;
+    if (runs[a].spec != NULL) {
+        int order = compare_fields(runs[a].spec, &runs[a].fields, &runs[b].fields);
+        if (order != 0) return order < 0;
+    }
+    return a < b;
+}
+
+// Loser tree over k runs: leaves are k .. 2k - 1, internal node i holds the loser
+// of the match played there and tree[0] the overall winner, so replacing the
+// winner's record costs one comparison per level.
+typedef struct {
+    int k;
+    int* tree;
+    RunReader* runs;
+} LoserTree;
+
+void loser_tree_build(LoserTree* lt, RunReader* runs, int k) {
+    lt->k = k;
+    lt->runs = runs;
+    lt->tree = (int*)counted_malloc(k * sizeof(int));
+    int* winner = (int*)counted_malloc(2 * k * sizeof(int));
+    if (lt->tree == NULL || winner == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    for (int i = 0; i < k; i++) winner[k + i] = i;
+    for (int i = k - 1; i >= 1; i--) {
+        int l = winner[2 * i], r = winner[2 * i + 1];
+        if (run_before(runs, l, r)) {
+            winner[i] = l;
+            lt->tree[i] = r;
+        } else {
+            winner[i] = r;
+            lt->tree[i] = l;
+        }
+    }
+    lt->tree[0] = (k > 1) ? winner[1] : 0;
+    free(winner);
+}
+
+// Replay the matches from the winner's leaf after its run advanced
+void loser_tree_replay(LoserTree* lt) {
+    int winner = lt->tree[0];
+    for (int node = (winner + lt->k) / 2; node >= 1; node /= 2) {
+        if (run_before(lt->runs, lt->tree[node], winner)) {
+            int tmp = lt->tree[node];
+            lt->tree[node] = winner;
+            winner = tmp;
+        }
+    }
+    lt->tree[0] = winner;
+}
+
+// Buffered sequential writer
+typedef struct {
+    int fd;
+    char* buf;
+    size_t capacity;
+    size_t len;
+} RunWriter;
+
+void writer_flush(RunWriter* w) {
+    struct iovec iov = { w->buf, w->len };
+    if (w->len > 0 && write_all_iov(w->fd, &iov, 1) != 0) {
+        perror("write");
+        exit(1);
+    }
+    w->len = 0;
+}
+
+void writer_put(RunWriter* w, const void* data, size_t len) {
+    if (w->len + len > w->capacity) {
+        writer_flush(w);
+        if (len > w->capacity) {
+            struct iovec iov = { (void*)data, len };
+            if (write_all_iov(w->fd, &iov, 1) != 0) {
+                perror("write");
+                exit(1);
+            }
+            return;
+        }
+    }
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+}
+
+// k-way merge of the run files fds[0 .. k) into out_fd. With keyed set the
+// output is itself a run file, otherwise only the record payloads are written.
+// Every run and the output get buffer_size bytes of buffer.
+void merge_runs(const int* fds, int k, int out_fd, int keyed, const SortSpec* spec, char format, size_t buffer_size) {
+    RunReader* runs = (RunReader*)counted_calloc(k, sizeof(RunReader));
+    RunWriter out = { out_fd, (char*)counted_malloc(buffer_size), buffer_size, 0 };
+    if (runs == NULL || out.buf == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    for (int r = 0; r < k; r++) {
+        runs[r].fd = fds[r];
+        runs[r].capacity = buffer_size;
+        runs[r].spec = spec;
+        runs[r].format = format;
+        runs[r].buf = (char*)counted_malloc(buffer_size);
+        if (runs[r].buf == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        if (lseek(fds[r], 0, SEEK_SET) < 0) {
+            perror("lseek");
+            exit(1);
+        }
+        run_next(&runs[r]);
+    }
+    
+    LoserTree lt;
+    loser_tree_build(&lt, runs, k);
+    while (!runs[lt.tree[0]].done) {
+        RunReader* run = &runs[lt.tree[0]];
+        if (keyed) {
+            writer_put(&out, run->payload - RUN_HEADER_SIZE, RUN_HEADER_SIZE + run->payload_len);
+        } else {
+            writer_put(&out, run->payload, run->payload_len);
+        }
+        run_next(run);
+        loser_tree_replay(&lt);
+    }
+    writer_flush(&out);
+    
+    for (int r = 0; r < k; r++) {
+        free(runs[r].buf);
+    }
+    free(lt.tree);
+    free(runs);
+    free(out.buf);
+}
+
+// External sort for inputs larger than memory. The input is read through a buffer
+// of mem_cap / 4 bytes of text, and each batch holds only as many of its records
+// as the rest of the cap can carry (their store columns, items, sort scratch and
+// formatted output). Each batch is parsed and sorted with the parallel engines and
+// written to a run file in tmp_dir, and the runs are then merged with a loser tree
+// whose buffers share the whole cap. When there are too many runs to give each a RUN_BUFFER_MIN buffer,
+// consecutive groups of runs are merged first. Returns the exit status.
+int external_sort(int in_fd, const char* column_arg, size_t mem_cap, const char* tmp_dir, char output_format) {
+    char sort_column[SORT_SPEC_LEN];
+    if (column_arg != NULL) {
+        snprintf(sort_column, sizeof(sort_column), "%s", column_arg);
+    } else if (read_trailing_column(in_fd, sort_column, sizeof(sort_column)) != 0) {
+        fprintf(stderr, "External sort needs the sort column up front: pass -c or a regular input file\n");
+        return 1;
+    }
+    SortSpec spec;
+    if (parse_sort_spec(sort_column, &spec) != 0) {
+        fprintf(stderr, "Invalid input for sort column\n");
+        return 1;
+    }
+    // Run records carry the first column's plain key; anything it leaves open
+    // (longer names, later columns) is compared from the payload in the merge
+    const SortSpec* tie_spec = (spec.ncols > 1 || spec.cols[0] == 'N') ? &spec : NULL;
+    
+    size_t capacity = mem_cap / 4;
+    if (capacity < RUN_BUFFER_MIN) capacity = RUN_BUFFER_MIN;
+    char* buf = (char*)counted_malloc(capacity);
+    if (buf == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    size_t len = 0, consumed = 0;
+    int eof = 0;
+    
+    int* run_fds = NULL;
+    int run_count = 0;
+    long long n = -1, done = 0;
+    
+    while (n < 0 || done < n) {
+        // Keep the unparsed tail and top the buffer up
+        if (!eof) {
+            memmove(buf, buf + consumed, len - consumed);
+            len -= consumed;
+            consumed = 0;
+            ssize_t got = read_full(in_fd, buf + len, capacity - len);
+            if (got < 0) {
+                perror("read");
+                return 1;
+            }
+            len += (size_t)got;
+            eof = (len < capacity);
+        }
+        
+        // The record count is on the first line; records start on the next one
+        if (n < 0) {
+            const char* p = buf;
+            int count;
+            while (p < buf + len && is_blank(*p)) p++;
+            p = parse_int(p, buf + len, &count);
+            if (p == NULL || count < 0) {
+                fprintf(stderr, "Invalid input for number of records\n");
+                return 1;
+            }
+            while (p < buf + len && *p != '\n') p++;
+            if (p < buf + len) p++;
+            consumed = (size_t)(p - buf);
+            n = count;
+            continue;
+        }
+        
+        // Only whole lines are parsed; a partial last line waits for the next batch
+        size_t end = len;
+        if (!eof) {
+            while (end > consumed && buf[end - 1] != '\n') end--;
+            if (end == consumed) {
+                // A single line longer than the buffer
+                capacity *= 2;
+                buf = (char*)counted_realloc(buf, capacity);
+                if (buf == NULL) {
+                    fprintf(stderr, "Memory allocation failed\n");
+                    exit(1);
+                }
+                continue;
+            }
+        }
+        
+        size_t newlines = 0;
+        for (const char* q = buf + consumed; (q = memchr(q, '\n', buf + end - q)) != NULL; q++) {
+            newlines++;
+        }
+        long long room = (long long)newlines + 1;
+        if (room > n - done) room = n - done;
+        
+        // Hold the batch to what the read buffer leaves of the cap. Besides its text
+        // a record costs its store columns, its item and the engines' scratch copy
+        // of it, and its formatted copy on the way to the run file (its text again
+        // plus the run header). Records that do not fit wait for the next batch, but
+        // a batch always takes at least one, however long its line.
+        size_t text_per_record = (end - consumed) / (newlines > 0 ? newlines : 1) + 1;
+        size_t record_bytes = sizeof(int) + sizeof(long long) + sizeof(unsigned long long) + 2 * sizeof(size_t) +
+                              sizeof(unsigned int) + 2 * sizeof(SortItem) + RUN_HEADER_SIZE + text_per_record;
+        size_t record_budget = (mem_cap > capacity + RUN_BUFFER_MIN) ? mem_cap - capacity : RUN_BUFFER_MIN;
+        long long fit = (long long)(record_budget / record_bytes);
+        if (fit < 1) fit = 1;
+        if (room > fit) room = fit;
+        
+        RecordStore store;
+        store_init(&store, (int)room);
+        store.arena = buf;
+        size_t column_pos;
+        int bad_record = parse_records(buf, consumed, end, &store, &column_pos);
+        if (bad_record < 0 && store.n == 0 && eof) {
+            bad_record = 0;
+        }
+        if (bad_record >= 0) {
+            fprintf(stderr, "Invalid input for record %lld\n", done + bad_record);
+            return 1;
+        }
+        
+        SortItem* items = (SortItem*)counted_malloc(store.n * sizeof(SortItem));
+        run_fds = (int*)counted_realloc(run_fds, (run_count + 1) * sizeof(int));
+        if ((items == NULL && store.n > 0) || run_fds == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        sort_records(&store, items, store.n, &spec);
+        if (spec.ncols > 1) {
+            rekey_items(&store, items, store.n, spec.cols[0]);
+        }
+        run_fds[run_count] = create_run_file(tmp_dir);
+        if (write_sorted(&store, items, store.n, output_format, 1, run_fds[run_count], NULL) != 0) {
+            perror("write");
+            exit(1);
+        }
+        run_count++;
+        done += store.n;
+        consumed = (column_pos < end) ? column_pos : end;
+        free(items);
+        store_free(&store);
+    }
+    free(buf);
+    
+    // Merge passes until every remaining run can get a RUN_BUFFER_MIN buffer
+    int fan_in = (int)(mem_cap / RUN_BUFFER_MIN) - 1;
+    if (fan_in < 2) fan_in = 2;
+    while (run_count > fan_in) {
+        int merged = 0;
+        for (int first = 0; first < run_count; first += fan_in) {
+            int k = (run_count - first < fan_in) ? run_count - first : fan_in;
+            int out_fd = create_run_file(tmp_dir);
+            merge_runs(run_fds + first, k, out_fd, 1, tie_spec, output_format, mem_cap / (k + 1));
+            for (int r = first; r < first + k; r++) close(run_fds[r]);
+            run_fds[merged++] = out_fd;
+        }
+        run_count = merged;
+    }
+    
+    if (output_format == 't') {
+        char header[sizeof(sort_column) + 1];
+        struct iovec iov = { header, (size_t)snprintf(header, sizeof(header), "%s\n", sort_column) };
+        if (write_all_iov(STDOUT_FILENO, &iov, 1) != 0) {
+            perror("write");
+            return 1;
+        }
+    }
+    size_t buffer_size = mem_cap / (run_count + 1);
+    if (buffer_size < RUN_BUFFER_MIN) buffer_size = RUN_BUFFER_MIN;
+    if (run_count > 0) {
+        merge_runs(run_fds, run_count, STDOUT_FILENO, 0, tie_spec, output_format, buffer_size);
+    }
+    for (int r = 0; r < run_count; r++) close(run_fds[r]);
+    free(run_fds);
+    return 0;
+}
+
+// Incremental catalog update: stream the existing sorted file (mmapped) and the
+// freshly sorted batch items[0, n) through one linear merge to stdout. Catalog
+// records are copied through byte for byte; only the batch is formatted. On
+// ties the catalog record comes first, as it was there earlier. The catalog
+// must be in format and, for text, start with the same sort spec line.
+// Returns the exit status.
+int merge_into_catalog(const char* catalog_path, const RecordStore* store, const SortItem* items, int n,
+                       const SortSpec* spec, const char* spec_text, char format) {
+    InputBuffer catalog;
+    if (load_input(catalog_path, &catalog) != 0) {
+        return 1;
+    }
+    const char* data = catalog.data;
+    size_t len = catalog.len;
+    size_t pos = 0;
+    
+    size_t spec_len = strlen(spec_text);
+    if (format == 't' && len > 0) {
+        const char* line_end = memchr(data, '\n', len);
+        size_t header_len = line_end ? (size_t)(line_end - data) : len;
+        while (header_len > 0 && is_blank(data[header_len - 1])) header_len--;
+        if (header_len != spec_len || memcmp(data, spec_text, spec_len) != 0) {
+            fprintf(stderr, "%s is not sorted by %s\n", catalog_path, spec_text);
+            release_input(&catalog);
+            return 1;
+        }
+        pos = line_end ? (size_t)(line_end - data) + 1 : len;
+    }
+    
+    size_t capacity = MERGE_BUFFER_SIZE;
+    if (capacity < store->max_name_len + MAX_FILENAME + TIMESTAMP_LEN + 32) {
+        capacity = store->max_name_len + MAX_FILENAME + TIMESTAMP_LEN + 32;
+    }
+    RunWriter out = { STDOUT_FILENO, (char*)counted_malloc(capacity), capacity, 0 };
+    if (out.buf == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    if (format == 't') {
+        writer_put(&out, spec_text, spec_len);
+        writer_put(&out, "\n", 1);
+    }
+    
+    RecordFields old_rec, prev_rec, new_rec;
+    long old_len = 0;
+    int have_old = 0, have_prev = 0;
+    int b = 0;
+    int status = 0;
+    while (1) {
+        if (!have_old) {
+            if (format == 't') {
+                while (pos < len && isspace((unsigned char)data[pos])) pos++;
+            }
+            if (pos < len) {
+                old_len = parse_formatted_record(data + pos, len - pos, format, &old_rec);
+                if (old_len < 0 || (have_prev && compare_fields(spec, &prev_rec, &old_rec) > 0)) {
+                    fprintf(stderr, "%s: unsorted or malformed record at byte %zu\n", catalog_path, pos);
+                    status = 1;
+                    break;
+                }
+                have_old = 1;
+            }
+        }
+        if (b < n) {
+            int r = (int)items[b].idx;
+            new_rec.name = store->arena + store->name_offs[r];
+            new_rec.name_len = (int)store->name_lens[r];
+            new_rec.id = store->ids[r];
+            new_rec.timestamp = store->timestamp_vals[r];
+        }
+        
+        if (b < n && (!have_old || compare_fields(spec, &new_rec, &old_rec) < 0)) {
+            if (out.len + record_size_bound(store, items[b].idx) > out.capacity) {
+                writer_flush(&out);
+            }
+            out.len += (format == 'b') ? format_record_binary(store, items[b].idx, out.buf + out.len)
+                                       : format_record_text(store, items[b].idx, out.buf + out.len);
+            b++;
+        } else if (have_old) {
+            writer_put(&out, data + pos, (size_t)old_len);
+            // A last text line without its newline still ends with one in the output
+            if (format == 't' && data[pos + old_len - 1] != '\n') {
+                writer_put(&out, "\n", 1);
+            }
+            prev_rec = old_rec;
+            have_prev = 1;
+            have_old = 0;
+            pos += (size_t)old_len;
+        } else {
+            break;
+        }
+    }
+    writer_flush(&out);
+    free(out.buf);
+    release_input(&catalog);
+    return status;
+}
+
+// Multi-process sort. The coordinator forks worker processes up front, each
+// tied to it by a Unix domain socket. Once the input is parsed, the records
+// are range partitioned by splitters sampled from the first column and written
+// straight into one shared memory region (a memfd) per worker, which is passed
+// over the socket with SCM_RIGHTS. A worker maps its region, parses it in
+// place, sorts it with the usual engines and writes the sorted record numbers
+// back into the tail of the same region, so record data is written once and
+// never copied through the sockets. The partitions are key ranges, which makes
+// the concatenation of the workers' results the final order. The message
+// layout is self-contained, so a remote worker could receive the same region
+// contents over a stream socket instead.
+typedef struct {
+    unsigned int count;          // records in the region
+    unsigned int status;         // reply: 0 once the results are written
+    unsigned long long payload_bytes;  // record bytes padded to 8; count u32 results follow them
+    char spec[SORT_SPEC_LEN];
+} WorkerJob;
+
+typedef struct {
+    const RecordStore* store;
+    int n;
+    int nworkers;
+    const unsigned long long* splitter_keys;  // nworkers - 1 splitters
+    const int* splitter_pos;
+    const SortItem* items;       // first column key of every record, by position
+    unsigned short* worker_of;
+    size_t* counts;              // nthreads x nworkers records
+    size_t* bytes;               // nthreads x nworkers bytes, turned into write offsets
+    WorkerJob* jobs;
+    char** regions;
+    int* region_fds;
+} ScatterArgs;
+
+// Each record in a region: u32 record number, then the binary output layout
+size_t scatter_record_size(const RecordStore* store, int i) {
+    return sizeof(unsigned int) * 2 + store->name_lens[i] + sizeof(int) + sizeof(long long);
+}
+
+// Create and map the shared region for a worker's partition
+char* create_region(size_t size, int* fd_out) {
+    int fd = memfd_create("lazysort-partition", MFD_CLOEXEC);
+    if (fd < 0 || ftruncate(fd, (off_t)size) != 0) {
+        perror("memfd_create");
+        exit(1);
+    }
+    char* region = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (region == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    *fd_out = fd;
+    return region;
+}
+
+// Pool task: classify the worker's chunk by splitter, then, once the regions
+// exist, write every record to its partition. Records keep the input order
+// within a partition (offsets are worker-major, thread-minor).
+void scatter_thread(void* arg, int tid, int nthreads) {
+    ScatterArgs* args = (ScatterArgs*)arg;
+    WorkerPool* pool = &sort_pool;
+    const RecordStore* store = args->store;
+    int nworkers = args->nworkers;
+    int start = chunk_start(tid, args->n, nthreads);
+    int end = chunk_start(tid + 1, args->n, nthreads);
+    size_t* count = args->counts + tid * nworkers;
+    size_t* bytes = args->bytes + tid * nworkers;
+    
+    for (int i = start; i < end; i++) {
+        int w = splitter_bucket(args->splitter_keys, args->splitter_pos, nworkers - 1, args->items[i].key, i);
+        args->worker_of[i] = (unsigned short)w;
+        count[w]++;
+        bytes[w] += scatter_record_size(store, i);
+    }
+    
+    if (pool_barrier(pool)) {
+        for (int w = 0; w < nworkers; w++) {
+            size_t records = 0, offset = 0;
+            for (int t = 0; t < nthreads; t++) {
+                size_t b = args->bytes[t * nworkers + w];
+                records += args->counts[t * nworkers + w];
+                args->bytes[t * nworkers + w] = offset;
+                offset += b;
+            }
+            args->jobs[w].count = (unsigned int)records;
+            // Pad the record bytes so the u32 results after them are aligned
+            args->jobs[w].payload_bytes = (offset + 7) & ~(size_t)7;
+            size_t size = args->jobs[w].payload_bytes + records * sizeof(unsigned int);
+            args->regions[w] = create_region((size > 0) ? size : 1, &args->region_fds[w]);
+        }
+    }
+    pool_barrier(pool);
+    
+    for (int i = start; i < end; i++) {
+        int w = args->worker_of[i];
+        char* p = args->regions[w] + bytes[w];
+        unsigned int number = (unsigned int)i;
+        memcpy(p, &number, sizeof(number));
+        bytes[w] += sizeof(number) + format_record_binary(store, i, p + sizeof(number));
+    }
+}
+
+// Send job (and with it the region fd) over the socket
+int send_job(int sock, WorkerJob* job, int region_fd) {
+    struct iovec iov = { job, sizeof(*job) };
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &region_fd, sizeof(int));
+    return (sendmsg(sock, &msg, 0) == (ssize_t)sizeof(*job)) ? 0 : -1;
+}
+
+// Receive a job and its region fd. Returns -1 when the coordinator is gone.
+int receive_job(int sock, WorkerJob* job, int* region_fd) {
+    struct iovec iov = { job, sizeof(*job) };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(sock, &msg, MSG_WAITALL) != (ssize_t)sizeof(*job)) return -1;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) return -1;
+    memcpy(region_fd, CMSG_DATA(cmsg), sizeof(int));
+    return 0;
+}
+
+// Worker process: sort one partition and report back. Returns the exit status.
+int worker_main(int sock) {
+    WorkerJob job;
+    int region_fd;
+    if (receive_job(sock, &job, &region_fd) != 0) return 1;
+    job.spec[SORT_SPEC_LEN - 1] = '\0';
+    SortSpec spec;
+    size_t size = job.payload_bytes + job.count * sizeof(unsigned int);
+    char* region = (char*)mmap(NULL, (size > 0) ? size : 1, PROT_READ | PROT_WRITE, MAP_SHARED, region_fd, 0);
+    close(region_fd);
+    if (region == MAP_FAILED || parse_sort_spec(job.spec, &spec) != 0) return 1;
+    
+    // Parse the region in place: the store's arena is the shared mapping
+    int n = (int)job.count;
+    RecordStore store;
+    store_init(&store, n);
+    store.arena = region;
+    unsigned int* numbers = (unsigned int*)counted_malloc(n * sizeof(unsigned int));
+    SortItem* items = (SortItem*)counted_malloc(n * sizeof(SortItem));
+    if ((numbers == NULL || items == NULL) && n > 0) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    const char* p = region;
+    const char* end = region + job.payload_bytes;
+    for (int i = 0; i < n; i++) {
+        RecordFields f;
+        long len = (end - p >= (long)sizeof(unsigned int))
+                 ? parse_formatted_record(p + sizeof(unsigned int), end - p - sizeof(unsigned int), 'b', &f) : -1;
+        if (len < 0) return 1;
+        memcpy(&numbers[i], p, sizeof(unsigned int));
+        store.name_offs[i] = (size_t)(f.name - region);
+        store.name_lens[i] = (unsigned int)f.name_len;
+        store.name_keys[i] = name_chunk_key(f.name, f.name_len, 0);
+        store.ids[i] = f.id;
+        store.timestamp_vals[i] = f.timestamp;
+        store.timestamp_offs[i] = 0;
+        if (store.name_lens[i] > store.max_name_len) store.max_name_len = store.name_lens[i];
+        p += sizeof(unsigned int) + len;
+    }
+    
+    sort_records(&store, items, n, &spec);
+    unsigned int* results = (unsigned int*)(region + job.payload_bytes);
+    for (int i = 0; i < n; i++) {
+        memcpy(&results[i], &numbers[items[i].idx], sizeof(unsigned int));
+    }
+    
+    job.status = 0;
+    int status = (write(sock, &job, sizeof(job)) == (ssize_t)sizeof(job)) ? 0 : 1;
+    pool_stop(&sort_pool);
+    munmap(region, (size > 0) ? size : 1);
+    free(items);
+    free(numbers);
+    store_free(&store);
+    return status;
+}
+
+// Fork nworkers worker processes, each with its own socket. Must run before the
+// sort pool starts, so that no threads are forked. Their threads default to an
+// even share of the CPUs.
+void spawn_workers(int nworkers, int* socks, pid_t* pids) {
+    int threads = sort_threads;
+    if (threads <= 0) {
+        threads = default_thread_count() / nworkers;
+        if (threads < 1) threads = 1;
+    }
+    for (int w = 0; w < nworkers; w++) {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) {
+            perror("socketpair");
+            exit(1);
+        }
+        pids[w] = fork();
+        if (pids[w] < 0) {
+            perror("fork");
+            exit(1);
+        }
+        if (pids[w] == 0) {
+            for (int v = 0; v < w; v++) close(socks[v]);
+            close(pair[0]);
+            sort_threads = threads;
+            _exit(worker_main(pair[1]));
+        }
+        close(pair[1]);
+        socks[w] = pair[0];
+    }
+}
+
+// Sort all records of store across the workers; items receives the final order.
+// Returns 0, or -1 if a worker failed.
+int distributed_sort(const RecordStore* store, SortItem* items, int n, const SortSpec* spec,
+                     const char* spec_text, int nworkers, const int* socks, const pid_t* pids) {
+    WorkerPool* pool = get_sort_pool();
+    build_sort_items(store, items, spec->cols[0]);
+    
+    // Splitters from an evenly spaced sample of the first column. When that
+    // column decides the order alone, equal keys may be split by position;
+    // otherwise runs of equal keys must stay with one worker.
+    int key_decides = (spec->ncols == 1 && (spec->cols[0] != 'N' || store->max_name_len <= 8));
+    int samples = nworkers * SAMPLE_SORT_OVERSAMPLE;
+    if (samples > n) samples = n;
+    SortItem* sample = (SortItem*)counted_malloc((samples * 2 + 1) * sizeof(SortItem));
+    unsigned long long splitter_keys[nworkers];
+    int splitter_pos[nworkers];
+    if (sample == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    for (int s = 0; s < samples; s++) {
+        int pos = (int)(((long long)s * n + n / 2) / samples);
+        sample[s].key = items[pos].key;
+        sample[s].idx = (unsigned int)pos;
+    }
+    merge_sort_sequential(sample, sample + samples, 0, samples, 0);
+    for (int w = 0; w < nworkers - 1; w++) {
+        if (samples == 0) {
+            splitter_keys[w] = ULLONG_MAX;
+            splitter_pos[w] = INT_MAX;
+            continue;
+        }
+        const SortItem* split = &sample[(long long)(w + 1) * samples / nworkers];
+        splitter_keys[w] = split->key;
+        splitter_pos[w] = key_decides ? (int)split->idx : -1;
+    }
+    free(sample);
+    
+    ScatterArgs args;
+    args.store = store;
+    args.n = n;
+    args.nworkers = nworkers;
+    args.splitter_keys = splitter_keys;
+    args.splitter_pos = splitter_pos;
+    args.items = items;
+    args.worker_of = (unsigned short*)counted_malloc(n * sizeof(unsigned short));
+    args.counts = (size_t*)counted_calloc(pool->nthreads * nworkers, sizeof(size_t));
+    args.bytes = (size_t*)counted_calloc(pool->nthreads * nworkers, sizeof(size_t));
+    args.jobs = (WorkerJob*)counted_calloc(nworkers, sizeof(WorkerJob));
+    args.regions = (char**)counted_calloc(nworkers, sizeof(char*));
+    args.region_fds = (int*)counted_calloc(nworkers, sizeof(int));
+    if ((args.worker_of == NULL && n > 0) || args.counts == NULL || args.bytes == NULL || args.jobs == NULL ||
+        args.regions == NULL || args.region_fds == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    pool_run(pool, scatter_thread, &args);
+    
+    int status = 0;
+    for (int w = 0; w < nworkers; w++) {
+        snprintf(args.jobs[w].spec, SORT_SPEC_LEN, "%s", spec_text);
+        if (send_job(socks[w], &args.jobs[w], args.region_fds[w]) != 0) status = -1;
+        close(args.region_fds[w]);
+    }
+    
+    // Gather: the partitions are consecutive key ranges
+    int pos = 0;
+    for (int w = 0; w < nworkers; w++) {
+        WorkerJob reply;
+        if (status == 0 && (read_full(socks[w], (char*)&reply, sizeof(reply)) != (ssize_t)sizeof(reply) ||
+                            reply.status != 0)) {
+            fprintf(stderr, "Worker %d failed\n", w);
+            status = -1;
+        }
+        size_t size = args.jobs[w].payload_bytes + args.jobs[w].count * sizeof(unsigned int);
+        if (status == 0) {
+            const unsigned int* results = (const unsigned int*)(args.regions[w] + args.jobs[w].payload_bytes);
+            for (unsigned int i = 0; i < args.jobs[w].count; i++) {
+                items[pos].idx = results[i];
+                items[pos].key = 0;
+                pos++;
+            }
+        }
+        munmap(args.regions[w], (size > 0) ? size : 1);
+        close(socks[w]);
+        waitpid(pids[w], NULL, 0);
+    }
+    
+    free(args.region_fds);
+    free(args.regions);
+    free(args.jobs);
+    free(args.bytes);
+    free(args.counts);
+    free(args.worker_of);
+    return status;
+}
+
+// Benchmarks (--bench) and synthetic inputs (--generate). The generator writes
+// ordinary text input. The benchmark parses, sorts and writes a generated input
+// with every engine at every thread count and reports one row per run.
+typedef struct {
+    const char* name;
+    char dist;                   // 'u' uniform, 's' skewed, 'p' presorted, 'd' duplicate heavy
+} Distribution;
+
+static const Distribution distributions[] = {
+    { "uniform", 'u' }, { "skewed", 's' }, { "presorted", 'p' }, { "duplicates", 'd' }
+};
+
+typedef struct {
+    const char* name;
+    char engine;                 // forced_engine value, 0 lets plan_sort choose
+} BenchEngine;
+
+static const BenchEngine bench_engines[] = {
+    { "auto", 0 }, { "radix", 'r' }, { "merge", 'm' }, { "sample", 'p' }, { "sequential", 's' }
+};
+
+typedef struct {
+    int n;
+    int dist;                    // index into distributions, -1 for all of them (--bench only)
+    int name_min;
+    int name_max;
+    unsigned long long seed;
+    const char* spec;
+} GeneratorConfig;
+
+// splitmix64
+unsigned long long next_random(unsigned long long* state) {
+    unsigned long long z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Key of record i of n in [0, range) under the distribution
+unsigned long long generated_key(char dist, int i, int n, unsigned long long range, unsigned long long* state) {
+    unsigned long long r = next_random(state);
+    switch (dist) {
+        case 's':                // roughly log-uniform, so small keys dominate
+            return (r % range) >> (next_random(state) % 24);
+        case 'p':                // ascending, with about 1% of the records out of place
+            if (r % 100 == 0) return next_random(state) % range;
+            return (unsigned long long)i * range / n;
+        case 'd':                // 16 distinct keys
+            return (r % 16) * (range / 16);
+        default:
+            return r % range;
+    }
+}
+
+// Generate a text input as described by config. Returns a malloc'ed buffer and sets *len.
+char* generate_input(const GeneratorConfig* config, char dist, size_t* len) {
+    static const char letters[] = "abcdefghijklmnopqrstuvwxyz.";
+    const long long ts_base = 946684800;     // 2000-01-01T00:00:00Z
+    const long long ts_range = 946080000;    // about 30 years
+    size_t cap = (size_t)config->n * (config->name_max + 1 + 11 + 1 + TIMESTAMP_LEN + 1) + 32 + SORT_SPEC_LEN;
+    char* buf = (char*)counted_malloc(cap);
+    if (buf == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    unsigned long long state = config->seed;
+    size_t pos = (size_t)sprintf(buf, "%d\n", config->n);
+    for (int i = 0; i < config->n; i++) {
+        // Duplicate heavy inputs also draw their names from 16 candidates
+        unsigned long long name_state = (dist == 'd') ? next_random(&state) % 16 : next_random(&state);
+        int span = config->name_max - config->name_min + 1;
+        int name_len = config->name_min + (int)(next_random(&name_state) % span);
+        for (int c = 0; c < name_len; c++) {
+            buf[pos++] = letters[next_random(&name_state) % (sizeof(letters) - 1)];
+        }
+        int id = (int)generated_key(dist, i, config->n, INT_MAX, &state);
+        time_t ts = (time_t)(ts_base + (long long)generated_key(dist, i, config->n, ts_range, &state));
+        struct tm tm;
+        gmtime_r(&ts, &tm);
+        pos += (size_t)sprintf(buf + pos, " %d ", id);
+        pos += strftime(buf + pos, TIMESTAMP_LEN + 1, "%Y-%m-%dT%H:%M:%S", &tm);
+        buf[pos++] = '\n';
+    }
+    pos += (size_t)sprintf(buf + pos, "%s\n", config->spec);
+    *len = pos;
+    return buf;
+}
+
+// Parse --dist: a distribution name, or "all" when allow_all is set. Returns 0, or -1.
+int parse_distribution(const char* text, int allow_all, int* dist) {
+    if (allow_all && strcmp(text, "all") == 0) {
+        *dist = -1;
+        return 0;
+    }
+    for (int d = 0; d < (int)(sizeof(distributions) / sizeof(distributions[0])); d++) {
+        if (strcmp(text, distributions[d].name) == 0) {
+            *dist = d;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Start peak RSS measurement over again, where the kernel supports it
+void reset_peak_rss(void) {
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd < 0) return;
+    if (write(fd, "5", 1) < 0) {
+        // Older kernels keep the lifetime peak
+    }
+    close(fd);
+}
+
+long peak_rss_kb(void) {
+    FILE* file = fopen("/proc/self/status", "r");
+    char line[256];
+    long kb = -1;
+    while (file != NULL && fgets(line, sizeof(line), file) != NULL) {
+        if (sscanf(line, "VmHWM: %ld kB", &kb) == 1) break;
+    }
+    if (file != NULL) fclose(file);
+    if (kb < 0) {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        kb = usage.ru_maxrss;
+    }
+    return kb;
+}
+
+// Run the benchmark matrix and print one CSV line or JSON object per run.
+// Returns 0, or 1 if a run failed.
+int run_bench(const GeneratorConfig* config, int json) {
+    int max_threads = (sort_threads > 0) ? sort_threads : default_thread_count();
+    int devnull = open("/dev/null", O_WRONLY);
+    if (devnull < 0) {
+        perror("/dev/null");
+        return 1;
+    }
+    if (json) {
+        printf("[\n");
+    } else {
+        printf("distribution,records,name_len_min,name_len_max,spec,engine,threads,"
+               "parse_ms,sort_ms,write_ms,total_ms,sort_mrecords_per_s,peak_rss_kb,allocations\n");
+    }
+    
+    int status = 0;
+    int rows = 0;
+    int ndists = (int)(sizeof(distributions) / sizeof(distributions[0]));
+    for (int d = 0; d < ndists && status == 0; d++) {
+        if (config->dist >= 0 && d != config->dist) continue;
+        size_t len;
+        char* text = generate_input(config, distributions[d].dist, &len);
+        InputBuffer input = { text, len, 0 };
+        
+        // 1, 2, 4, ... threads, and always the full count
+        for (int threads = 1; status == 0; threads = (threads * 2 < max_threads) ? threads * 2 : max_threads) {
+            pool_stop(&sort_pool);
+            sort_threads = threads;
+            cost_profile.loaded = 0;
+            get_cost_profile(0);
+            
+            for (int e = 0; e < (int)(sizeof(bench_engines) / sizeof(bench_engines[0])); e++) {
+                forced_engine = bench_engines[e].engine;
+                reset_peak_rss();
+                long allocs = atomic_load(&alloc_count);
+                struct timespec start;
+                
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                RecordStore store;
+                char sort_column[SORT_SPEC_LEN];
+                if (parse_text_input(&input, &store, sort_column, sizeof(sort_column)) != 0) {
+                    status = 1;
+                    break;
+                }
+                double parse_ms = elapsed_ns(&start) / 1e6;
+                
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                SortSpec spec;
+                parse_sort_spec(sort_column, &spec);
+                int n = store.n;
+                SortItem* items = (SortItem*)counted_malloc((n > 0 ? n : 1) * sizeof(SortItem));
+                if (items == NULL) {
+                    fprintf(stderr, "Memory allocation failed\n");
+                    exit(1);
+                }
+                sort_records(&store, items, n, &spec);
+                double sort_ms = elapsed_ns(&start) / 1e6;
+                
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                char header[SORT_SPEC_LEN + 1];
+                snprintf(header, sizeof(header), "%s\n", sort_column);
+                if (write_sorted(&store, items, n, 't', 0, devnull, header) != 0) {
+                    perror("write");
+                    status = 1;
+                }
+                double write_ms = elapsed_ns(&start) / 1e6;
+                free(items);
+                store_free(&store);
+                
+                double total_ms = parse_ms + sort_ms + write_ms;
+                double throughput = (sort_ms > 0) ? n / (sort_ms * 1e3) : 0;
+                long rss = peak_rss_kb();
+                allocs = atomic_load(&alloc_count) - allocs;
+                if (json) {
+                    printf("%s  {\"distribution\": \"%s\", \"records\": %d, \"name_len_min\": %d, \"name_len_max\": %d, "
+                           "\"spec\": \"%s\", \"engine\": \"%s\", \"threads\": %d, \"parse_ms\": %.3f, "
+                           "\"sort_ms\": %.3f, \"write_ms\": %.3f, \"total_ms\": %.3f, \"sort_mrecords_per_s\": %.3f, "
+                           "\"peak_rss_kb\": %ld, \"allocations\": %ld}",
+                           (rows > 0) ? ",\n" : "", distributions[d].name, n, config->name_min, config->name_max,
+                           config->spec, bench_engines[e].name, threads, parse_ms, sort_ms, write_ms, total_ms,
+                           throughput, rss, allocs);
+                } else {
+                    printf("%s,%d,%d,%d,\"%s\",%s,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%ld,%ld\n",
+                           distributions[d].name, n, config->name_min, config->name_max, config->spec,
+                           bench_engines[e].name, threads, parse_ms, sort_ms, write_ms, total_ms, throughput, rss, allocs);
+                }
+                fflush(stdout);
+                rows++;
+            }
+            if (threads == max_threads) break;
+        }
+        free(text);
+    }
+    if (json) {
+        printf("\n]\n");
+    }
+    forced_engine = 0;
+    close(devnull);
+    return status;
+}
+
+int main(int argc, char* argv[]) {
+    const char* input_path = NULL;
+    char output_format = 't';
+    const char* column_arg = NULL;
+    size_t mem_cap = 0;
+    const char* tmp_dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    static struct option long_options[] = {
+        { "input", required_argument, NULL, 'i' },
+        { "format", required_argument, NULL, 'f' },
+        { "column", required_argument, NULL, 'c' },
+        { "memory", required_argument, NULL, 'M' },
+        { "tmpdir", required_argument, NULL, 'T' },
+        { "calibrate", no_argument, NULL, 'C' },
+        { "threads", required_argument, NULL, 'j' },
+        { "top", required_argument, NULL, 'k' },
+        { "pages", no_argument, NULL, 'P' },
+        { "from", required_argument, NULL, 'F' },
+        { "to", required_argument, NULL, 'U' },
+        { "merge", required_argument, NULL, 'm' },
+        { "workers", required_argument, NULL, 'w' },
+        { "convert", no_argument, NULL, 'V' },
+        { "bench", optional_argument, NULL, 'B' },
+        { "generate", required_argument, NULL, 'G' },
+        { "records", required_argument, NULL, 'N' },
+        { "dist", required_argument, NULL, 'D' },
+        { "name-len", required_argument, NULL, 'L' },
+        { "seed", required_argument, NULL, 'S' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    int calibrate = 0;
+    int top = 0;
+    int pages = 0;
+    const char* range_from = NULL;
+    const char* range_to = NULL;
+    const char* catalog_path = NULL;
+    int nworkers = 0;
+    int convert = 0;
+    int bench = 0;               // 'c' CSV, 'j' JSON
+    int generate = 0;
+    const char* dist_arg = NULL;
+    GeneratorConfig gen = { 1000000, -1, 1, 8, 1, "ID" };
+    while ((opt = getopt_long(argc, argv, "i:f:c:M:T:j:k:m:w:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'i': input_path = optarg; break;
+            case 'c': column_arg = optarg; break;
+            case 'T': tmp_dir = optarg; break;
+            case 'C': calibrate = 1; break;
+            case 'P': pages = 1; break;
+            case 'F': range_from = optarg; break;
+            case 'U': range_to = optarg; break;
+            case 'm': catalog_path = optarg; break;
+            case 'V': convert = 1; output_format = 'c'; break;
+            case 'D': dist_arg = optarg; break;
+            case 'S': gen.seed = strtoull(optarg, NULL, 10); break;
+            case 'B':
+                if (optarg == NULL || strcmp(optarg, "csv") == 0) bench = 'c';
+                else if (strcmp(optarg, "json") == 0) bench = 'j';
+                else {
+                    fprintf(stderr, "Unknown benchmark format %s (expected csv or json)\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'G':
+            case 'N':
+                gen.n = atoi(optarg);
+                if (gen.n <= 0) {
+                    fprintf(stderr, "Invalid record count %s\n", optarg);
+                    return 1;
+                }
+                generate |= (opt == 'G');
+                break;
+            case 'L': {
+                int fields = sscanf(optarg, "%d-%d", &gen.name_min, &gen.name_max);
+                if (fields == 1) gen.name_max = gen.name_min;
+                if (fields < 1 || gen.name_min < 1 || gen.name_max < gen.name_min || gen.name_max > 255) {
+                    fprintf(stderr, "Invalid name length %s (expected MIN-MAX between 1 and 255)\n", optarg);
+                    return 1;
+                }
+                break;
+            }
+            case 'w':
+                nworkers = atoi(optarg);
+                if (nworkers <= 0 || nworkers > USHRT_MAX) {
+                    fprintf(stderr, "Invalid worker count %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'k':
+                top = atoi(optarg);
+                if (top <= 0) {
+                    fprintf(stderr, "Invalid top count %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'j':
+                sort_threads = atoi(optarg);
+                if (sort_threads <= 0) {
+                    fprintf(stderr, "Invalid thread count %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'M':
+                mem_cap = parse_size(optarg);
+                if (mem_cap == 0) {
+                    fprintf(stderr, "Invalid memory size %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'f':
+                if (strcmp(optarg, "text") == 0) output_format = 't';
+                else if (strcmp(optarg, "binary") == 0) output_format = 'b';
+                else if (strcmp(optarg, "columnar") == 0) output_format = 'c';
+                else {
+                    fprintf(stderr, "Unknown output format %s (expected text, binary or columnar)\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-i input_file] [-f text|binary|columnar] [-c column] [-M memory_cap [-T tmp_dir]] [-j threads] [-k top [--pages]] [--from value] [--to value] [-m sorted_file] [-w workers] [--convert] [--calibrate]\n"
+                                "       %s --generate records|--bench[=csv|json] [--records n] [--dist name] [--name-len min-max] [--seed s] [-c column] [-j threads]\n",
+                        argv[0], argv[0]);
+                return 1;
+        }
+    }
+    
+    // Benchmarks and generated inputs need none of the input options
+    if (bench || generate) {
+        SortSpec check;
+        if (column_arg != NULL) gen.spec = column_arg;
+        if (bench && generate) {
+            fprintf(stderr, "--bench and --generate cannot be combined\n");
+            return 1;
+        }
+        if (input_path != NULL || mem_cap > 0 || catalog_path != NULL || nworkers > 0 || top > 0 ||
+            range_from != NULL || range_to != NULL || convert) {
+            fprintf(stderr, "--bench and --generate cannot be combined with -i, -M, -k, --from, --to, -m, -w or --convert\n");
+            return 1;
+        }
+        if (parse_sort_spec(gen.spec, &check) != 0) {
+            fprintf(stderr, "Invalid sort column %s\n", gen.spec);
+            return 1;
+        }
+        if (dist_arg != NULL && parse_distribution(dist_arg, bench, &gen.dist) != 0) {
+            fprintf(stderr, "Unknown distribution %s\n", dist_arg);
+            return 1;
+        }
+        if (calibrate) {
+            get_cost_profile(1);
+        }
+        int status;
+        if (bench) {
+            status = run_bench(&gen, bench == 'j');
+        } else {
+            size_t len;
+            char* text = generate_input(&gen, distributions[(gen.dist < 0) ? 0 : gen.dist].dist, &len);
+            struct iovec iov = { text, len };
+            status = (write_all_iov(STDOUT_FILENO, &iov, 1) == 0) ? 0 : 1;
+            if (status != 0) perror("write");
+            free(text);
+        }
+        pool_stop(&sort_pool);
+        return status;
+    }
+    
+    // Reject conflicting options before any worker process is forked
+    int selecting = (top > 0 || range_from != NULL || range_to != NULL);
+    if (nworkers > 0 && (mem_cap > 0 || catalog_path != NULL || selecting)) {
+        fprintf(stderr, "-w cannot be combined with -M, -k, --from, --to or -m\n");
+        return 1;
+    }
+    if (output_format == 'c' && (mem_cap > 0 || catalog_path != NULL || selecting)) {
+        fprintf(stderr, "Columnar output cannot be combined with -M, -k, --from, --to or -m\n");
+        return 1;
+    }
+    if (convert && nworkers > 0) {
+        fprintf(stderr, "--convert cannot be combined with -w\n");
+        return 1;
+    }
+    if (catalog_path != NULL && (selecting || mem_cap > 0)) {
+        fprintf(stderr, "-m cannot be combined with -M, -k, --from or --to\n");
+        return 1;
+    }
+    if (mem_cap > 0 && selecting) {
+        fprintf(stderr, "Top-K and range selection are not supported with -M\n");
+        return 1;
+    }
+    
+    // Workers are forked before this process starts any threads
+    int* worker_socks = NULL;
+    pid_t* worker_pids = NULL;
+    if (nworkers > 0) {
+        worker_socks = (int*)counted_malloc(nworkers * sizeof(int));
+        worker_pids = (pid_t*)counted_malloc(nworkers * sizeof(pid_t));
+        if (worker_socks == NULL || worker_pids == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            return 1;
+        }
+        spawn_workers(nworkers, worker_socks, worker_pids);
+    }
+    
+    if (calibrate) {
+        get_cost_profile(1);
+    }
+    
+    // With a memory cap the input is streamed through run files instead of loaded whole
+    if (mem_cap > 0) {
+        int in_fd = STDIN_FILENO;
+        if (input_path != NULL && (in_fd = open(input_path, O_RDONLY)) < 0) {
+            perror(input_path);
+            return 1;
+        }
+        int status = external_sort(in_fd, column_arg, mem_cap, tmp_dir, output_format);
+        pool_stop(&sort_pool);
+        return status;
+    }
+    
+    InputBuffer input;
+    if (load_input(input_path, &input) != 0) {
+        return 1;
+    }
+    
+    // Columnar files are mapped as they are, text is parsed
+    RecordStore store;
+    char sort_column[SORT_SPEC_LEN];
+    int load_status = is_columnar(&input) ? load_columnar(&input, &store, sort_column, sizeof(sort_column))
+                                          : parse_text_input(&input, &store, sort_column, sizeof(sort_column));
+    if (load_status != 0) {
+        release_input(&input);
+        return 1;
+    }
+    if (column_arg != NULL) {
+        snprintf(sort_column, sizeof(sort_column), "%s", column_arg);
+    }
+    int n = store.n;
+    SortSpec spec;
+    if (parse_sort_spec(sort_column, &spec) != 0) {
+        fprintf(stderr, "Invalid input for sort column\n");
+        store_free(&store);
+        release_input(&input);
+        return 1;
+    }
+    
+    unsigned long long bound_key;
+    const char* bounds[2] = { range_from, range_to };
+    for (int b = 0; b < 2; b++) {
+        if (bounds[b] != NULL && parse_bound(bounds[b], spec.cols[0], &bound_key) != 0) {
+            fprintf(stderr, "Invalid range bound %s\n", bounds[b]);
+            store_free(&store);
+            release_input(&input);
+            return 1;
+        }
+    }
+    
+    SortItem* items = (SortItem*)counted_malloc(n * sizeof(SortItem));
+    if (items == NULL && n > 0) {
+        fprintf(stderr, "Memory allocation failed\n");
+        store_free(&store);
+        release_input(&input);
+        return 1;
+    }
+    
+    // Print sorted records, reading each one through its index.
+    // The binary format carries no header line.
+    char header[sizeof(sort_column) + 1];
+    snprintf(header, sizeof(header), "%s\n", sort_column);
+    int status;
+    if (catalog_path != NULL) {
+        sort_records(&store, items, n, &spec);
+        int merge_status = merge_into_catalog(catalog_path, &store, items, n, &spec, sort_column, output_format);
+        pool_stop(&sort_pool);
+        free(items);
+        store_free(&store);
+        release_input(&input);
+        return merge_status;
+    } else if (selecting) {
+        status = write_selected(&store, items, n, &spec, range_from, range_to, top, pages, output_format,
+                                (output_format == 't') ? header : NULL);
+    } else if (convert) {
+        // Keep the input order; the identity items carry ID keys, which are not written
+        build_sort_items(&store, items, 'I');
+        status = write_columnar(&store, items, n, sort_column, STDOUT_FILENO);
+    } else if (nworkers > 0) {
+        // A failed worker has been reported already, hence status 1 rather than -1
+        status = (distributed_sort(&store, items, n, &spec, sort_column, nworkers, worker_socks, worker_pids) == 0)
+               ? write_output(&store, items, n, output_format, sort_column, header)
+               : 1;
+    } else {
+        sort_records(&store, items, n, &spec);
+        status = write_output(&store, items, n, output_format, sort_column, header);
+    }
+    if (status < 0) {
+        perror("write");
+    }
+    
+    pool_stop(&sort_pool);
+    free(worker_pids);
+    free(worker_socks);
+    free(items);
+    store_free(&store);
+    release_input(&input);
+    return (status == 0) ? 0 : 1;
+}